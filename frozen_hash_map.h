@@ -0,0 +1,234 @@
+// Author: yasushi.saito@gmail.com
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// FrozenHashMap is an immutable map built with a minimal perfect hash
+// function. Use Freeze() to convert an InlinedHashMap or a HopScotchHashMap
+// that won't be modified any more.
+//
+// The construction is the "hash and displace" scheme of CHD and PTHash. The
+// keys are split into buckets of FrozenHashMap::kAverageBucketSize keys on
+// average. For each bucket, starting with the largest, we search for a pilot
+// value that maps every key in the bucket to a distinct free slot. Buckets
+// with a single key store the slot number directly in the pilot. Every key
+// lands in one of exactly size() slots, so a lookup reads one pilot and one
+// slot, and the memory footprint is size() elements plus 4 /
+// kAverageBucketSize bytes of pilots per key.
+//
+// Keys must be distinct. Keys whose Hash value equals that of an earlier key
+// can't be told apart by any pilot, so they are kept in a side list after the
+// slots, which find() scans linearly when the slot doesn't hold the key.
+template <typename Key, typename Value, typename Hash = std::hash<Key>,
+          typename EqualTo = std::equal_to<Key>>
+class FrozenHashMap {
+ public:
+  using Elem = std::pair<Key, Value>;
+  using value_type = Elem;
+  using key_type = Key;
+  using mapped_type = Value;
+  using iterator = const Elem*;
+  using const_iterator = const Elem*;
+
+  static constexpr int kAverageBucketSize = 3;
+
+  FrozenHashMap(const Hash& hash = Hash(), const EqualTo& equal_to = EqualTo())
+      : hash_(hash), equal_to_(equal_to) {}
+
+  // Build a map that contains "elems".
+  explicit FrozenHashMap(std::vector<Elem> elems, const Hash& hash = Hash(),
+                         const EqualTo& equal_to = EqualTo())
+      : hash_(hash), equal_to_(equal_to), elems_(std::move(elems)) {
+    assert(elems_.size() < kDirect);
+    if (elems_.empty()) return;
+    num_slots_ = MoveCollisionsToEnd();
+    std::vector<uint32_t> slots;
+    uint64_t seed = 0;
+    for (int attempt = 0;; ++attempt) {
+      if (attempt >= kMaxAttempts) abort();
+      seed = Mix(seed + 0x9e3779b97f4a7c15ULL);
+      if (Build(seed, &slots)) break;
+    }
+    seed_ = seed;
+    // Permute elems_ so that elems_[i] is stored in slot i.
+    for (uint32_t i = 0; i < num_slots_; ++i) {
+      while (slots[i] != i) {
+        const uint32_t j = slots[i];
+        std::swap(elems_[i], elems_[j]);
+        std::swap(slots[i], slots[j]);
+      }
+    }
+  }
+
+  const_iterator begin() const { return elems_.data(); }
+  const_iterator end() const { return elems_.data() + elems_.size(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  bool empty() const { return elems_.empty(); }
+  size_t size() const { return elems_.size(); }
+  Hash hash_function() const { return hash_; }
+  EqualTo key_eq() const { return equal_to_; }
+
+  const_iterator find(const Key& k) const {
+    if (elems_.empty()) return end();
+    const uint64_t h = Mix(hash_(k) ^ seed_);
+    const Elem& elem = elems_[Slot(h, pilots_[Reduce(h, pilots_.size())])];
+    if (equal_to_(elem.first, k)) return &elem;
+    for (size_t i = num_slots_; i < elems_.size(); ++i) {
+      if (equal_to_(elems_[i].first, k)) return &elems_[i];
+    }
+    return end();
+  }
+
+ private:
+  // Pilot values with this bit set store the slot number in the lower bits.
+  static constexpr uint32_t kDirect = 1U << 31;
+  // Max number of pilot values to try for a bucket before picking another
+  // seed.
+  static constexpr uint32_t kMaxPilot = 1U << 24;
+  static constexpr int kMaxAttempts = 16;
+
+  // 64-bit finalizer of MurmurHash3.
+  static uint64_t Mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  // Map "h" to [0, n) without a division.
+  static size_t Reduce(uint64_t h, size_t n) {
+    return static_cast<size_t>((static_cast<unsigned __int128>(h) * n) >> 64);
+  }
+
+  size_t Slot(uint64_t h, uint32_t pilot) const {
+    if (pilot & kDirect) return pilot & ~kDirect;
+    return Reduce(Mix(h ^ Mix(pilot + 1)), num_slots_);
+  }
+
+  // Move the elements whose hash equals that of another element, except the
+  // first of each group, to the end of elems_. Returns the number of the
+  // remaining elements, which get slots.
+  size_t MoveCollisionsToEnd() {
+    const size_t n = elems_.size();
+    std::vector<std::pair<size_t, uint32_t>> hashes(n);
+    for (uint32_t i = 0; i < n; ++i) hashes[i] = {hash_(elems_[i].first), i};
+    std::sort(hashes.begin(), hashes.end());
+    std::vector<bool> collides(n, false);
+    size_t num_collisions = 0;
+    for (size_t i = 1; i < n; ++i) {
+      if (hashes[i].first == hashes[i - 1].first) {
+        collides[hashes[i].second] = true;
+        ++num_collisions;
+      }
+    }
+    if (num_collisions == 0) return n;
+    std::vector<Elem> elems;
+    elems.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      if (!collides[i]) elems.push_back(std::move(elems_[i]));
+    }
+    for (size_t i = 0; i < n; ++i) {
+      if (collides[i]) elems.push_back(std::move(elems_[i]));
+    }
+    elems_.swap(elems);
+    return n - num_collisions;
+  }
+
+  // Try to find pilots with the given seed. On success, fill pilots_, set
+  // (*slots)[i] to the slot of elems_[i], and return true.
+  bool Build(uint64_t seed, std::vector<uint32_t>* slots) {
+    const size_t n = num_slots_;
+    const size_t num_buckets = (n + kAverageBucketSize - 1) / kAverageBucketSize;
+    std::vector<uint64_t> hashes(n);
+    std::vector<uint32_t> bucket_start(num_buckets + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+      hashes[i] = Mix(hash_(elems_[i].first) ^ seed);
+      ++bucket_start[Reduce(hashes[i], num_buckets) + 1];
+    }
+    // Counting-sort the elements by bucket.
+    size_t max_bucket_size = 0;
+    for (size_t b = 0; b < num_buckets; ++b) {
+      max_bucket_size = std::max<size_t>(max_bucket_size, bucket_start[b + 1]);
+      bucket_start[b + 1] += bucket_start[b];
+    }
+    std::vector<uint32_t> members(n);
+    {
+      std::vector<uint32_t> cursor(bucket_start.begin(), bucket_start.end() - 1);
+      for (size_t i = 0; i < n; ++i) {
+        members[cursor[Reduce(hashes[i], num_buckets)]++] = i;
+      }
+    }
+    // Counting-sort the buckets by size, largest first.
+    std::vector<std::vector<uint32_t>> buckets_by_size(max_bucket_size + 1);
+    for (size_t b = 0; b < num_buckets; ++b) {
+      buckets_by_size[bucket_start[b + 1] - bucket_start[b]].push_back(b);
+    }
+
+    pilots_.assign(num_buckets, 0);
+    slots->assign(n, 0);
+    std::vector<bool> taken(n, false);
+    for (size_t size = max_bucket_size; size >= 2; --size) {
+      for (uint32_t b : buckets_by_size[size]) {
+        const uint32_t* begin = &members[bucket_start[b]];
+        uint32_t pilot = 0;
+        for (;; ++pilot) {
+          if (pilot >= kMaxPilot) return false;
+          size_t k = 0;
+          for (; k < size; ++k) {
+            const size_t slot = Slot(hashes[begin[k]], pilot);
+            if (taken[slot]) break;
+            taken[slot] = true;
+            (*slots)[begin[k]] = slot;
+          }
+          if (k == size) break;
+          while (k > 0) taken[(*slots)[begin[--k]]] = false;
+        }
+        pilots_[b] = pilot;
+      }
+    }
+    size_t free_slot = 0;
+    for (uint32_t b : buckets_by_size[1]) {
+      while (taken[free_slot]) ++free_slot;
+      taken[free_slot] = true;
+      (*slots)[members[bucket_start[b]]] = free_slot;
+      pilots_[b] = kDirect | free_slot;
+    }
+    return true;
+  }
+
+  Hash hash_;
+  EqualTo equal_to_;
+  uint64_t seed_ = 0;
+  std::vector<uint32_t> pilots_;
+  // Number of slots. The rest of elems_ is the side list of colliding keys.
+  size_t num_slots_ = 0;
+  // elems_[i] is the element stored in slot i, for i < num_slots_.
+  std::vector<Elem> elems_;
+};
+
+// Build a FrozenHashMap that contains the elements of "map", which can be an
+// InlinedHashMap, a HopScotchHashMap, or any other map that defines the
+// standard member types, hash_function(), and key_eq(). The frozen map uses
+// copies of the hasher and the key comparer of "map".
+template <typename Map>
+FrozenHashMap<typename Map::key_type, typename Map::mapped_type,
+              typename Map::hasher, typename Map::key_equal>
+Freeze(const Map& map) {
+  std::vector<std::pair<typename Map::key_type, typename Map::mapped_type>>
+      elems;
+  elems.reserve(map.size());
+  for (const auto& elem : map) elems.emplace_back(elem.first, elem.second);
+  return FrozenHashMap<typename Map::key_type, typename Map::mapped_type,
+                       typename Map::hasher, typename Map::key_equal>(
+      std::move(elems), map.hash_function(), map.key_eq());
+}
@@ -0,0 +1,413 @@
+// Author: yasushi.saito@gmail.com
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Instrumentation shared by InlinedHashTable and HopScotchHashTable.
+
+// Passed to Options::OnResize() at the start and at the end of every
+// expansion of a table.
+struct HashTableResizeEvent {
+  enum Phase { START, END };
+  Phase phase;
+  size_t old_capacity;
+  size_t new_capacity;
+  // Number of elements in the table.
+  size_t size;
+  // Time spent moving the elements to the new array. Zero at START.
+  std::chrono::nanoseconds elapsed;
+};
+
+// A template hack to call Options::OnResize only when it's defined.
+template <typename Options, typename Fn>
+auto SfinaeHashTableResize(const Options* options, size_t old_capacity,
+                           size_t new_capacity, size_t size, Fn* resize, int)
+    -> decltype(options->OnResize(std::declval<HashTableResizeEvent>())) {
+  HashTableResizeEvent event{HashTableResizeEvent::START, old_capacity,
+                             new_capacity, size, std::chrono::nanoseconds(0)};
+  options->OnResize(event);
+  const auto start = std::chrono::steady_clock::now();
+  (*resize)();
+  event.phase = HashTableResizeEvent::END;
+  event.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start);
+  return options->OnResize(event);
+}
+template <typename Options, typename Fn>
+void SfinaeHashTableResize(const Options*, size_t, size_t, size_t, Fn* resize,
+                           long) {
+  (*resize)();
+}
+
+// Call resize(), which expands a table from "old_capacity" to "new_capacity"
+// with "size" elements in it. If Options defines
+//
+//   void OnResize(const HashTableResizeEvent& event) const;
+//
+// call it before and after resize(). Otherwise, this is just resize(); it
+// doesn't even read the clock.
+template <typename Options, typename Fn>
+void HashTableResize(const Options& options, size_t old_capacity,
+                     size_t new_capacity, size_t size, Fn resize) {
+  SfinaeHashTableResize(&options, old_capacity, new_capacity, size, &resize,
+                        0);
+}
+
+// Process-wide registry of live tables, for attributing memory usage. A table
+// registers itself on construction and unregisters itself on destruction if
+// its Options defines
+//
+//   const char* RegistryTag() const;
+//
+// The tables are grouped by the tag. If RegistryTag() returns nullptr, the
+// name of the table's type is used as the tag. Tables whose Options don't
+// define RegistryTag() never touch the registry.
+//
+// Registration takes a mutex, so it adds to the cost of creating, copying,
+// and expanding a table.
+class HashTableRegistry {
+ public:
+  // Usage of one table, or the sum over a group of tables.
+  struct Usage {
+    size_t num_tables = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+    size_t num_tombstones = 0;
+    // Bytes of the table objects, including the inlined elements.
+    size_t inlined_bytes = 0;
+    // Bytes allocated on the heap for the outlined elements.
+    size_t outlined_bytes = 0;
+
+    double load_factor() const {
+      return capacity == 0 ? 0 : static_cast<double>(size) / capacity;
+    }
+  };
+
+  static HashTableRegistry* Get() {
+    static HashTableRegistry* registry = new HashTableRegistry;
+    return registry;
+  }
+
+  // "get_usage(table)" returns the usage of "table". "tag" must outlive the
+  // registration.
+  void Register(const void* table, const char* tag,
+                Usage (*get_usage)(const void*)) {
+    std::lock_guard<std::mutex> lock(mu_);
+    tables_[table] = Entry{tag, get_usage};
+  }
+
+  void Unregister(const void* table) {
+    std::lock_guard<std::mutex> lock(mu_);
+    tables_.erase(table);
+  }
+
+  // Returns the usage of the live tables, summed by tag.
+  //
+  // The tables are read without synchronizing with their users, so call this
+  // when no table is being modified, or treat the result as approximate. It
+  // locks a mutex and allocates memory, so a signal handler should ask
+  // another thread to call it.
+  std::map<std::string, Usage> Aggregate() const {
+    std::map<std::string, Usage> result;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& kv : tables_) {
+      const Usage usage = kv.second.get_usage(kv.first);
+      Usage* sum = &result[kv.second.tag];
+      ++sum->num_tables;
+      sum->size += usage.size;
+      sum->capacity += usage.capacity;
+      sum->num_tombstones += usage.num_tombstones;
+      sum->inlined_bytes += usage.inlined_bytes;
+      sum->outlined_bytes += usage.outlined_bytes;
+    }
+    return result;
+  }
+
+  // Returns Aggregate() with one line per tag.
+  std::string DumpText() const {
+    std::string out;
+    char buf[512];
+    for (const auto& kv : Aggregate()) {
+      const Usage& u = kv.second;
+      snprintf(buf, sizeof(buf),
+               "%s: tables=%zu size=%zu capacity=%zu load_factor=%.3f "
+               "tombstones=%zu inlined_bytes=%zu outlined_bytes=%zu\n",
+               kv.first.c_str(), u.num_tables, u.size, u.capacity,
+               u.load_factor(), u.num_tombstones, u.inlined_bytes,
+               u.outlined_bytes);
+      out += buf;
+    }
+    return out;
+  }
+
+  // Returns Aggregate() as a JSON object keyed by tag.
+  std::string DumpJson() const {
+    std::string out = "{";
+    char buf[512];
+    for (const auto& kv : Aggregate()) {
+      const Usage& u = kv.second;
+      if (out.size() > 1) out += ",";
+      out += JsonString(kv.first);
+      snprintf(buf, sizeof(buf),
+               ":{\"tables\":%zu,\"size\":%zu,\"capacity\":%zu,"
+               "\"load_factor\":%.3f,\"tombstones\":%zu,"
+               "\"inlined_bytes\":%zu,\"outlined_bytes\":%zu}",
+               u.num_tables, u.size, u.capacity, u.load_factor(),
+               u.num_tombstones, u.inlined_bytes, u.outlined_bytes);
+      out += buf;
+    }
+    return out + "}";
+  }
+
+ private:
+  struct Entry {
+    const char* tag;
+    Usage (*get_usage)(const void*);
+  };
+
+  static std::string JsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+    return out + "\"";
+  }
+
+  mutable std::mutex mu_;
+  std::unordered_map<const void*, Entry> tables_;
+};
+
+// A template hack to register a table only when Options::RegistryTag is
+// defined. Table must define "HashTableRegistry::Usage RegistryUsage() const".
+template <typename Table, typename Options>
+auto SfinaeHashTableRegister(const Table* table, const Options* options, int)
+    -> decltype(options->RegistryTag(), void()) {
+  const char* tag = options->RegistryTag();
+  HashTableRegistry::Get()->Register(
+      table, tag != nullptr ? tag : typeid(Table).name(), [](const void* t) {
+        return static_cast<const Table*>(t)->RegistryUsage();
+      });
+}
+template <typename Table, typename Options>
+void SfinaeHashTableRegister(const Table*, const Options*, long) {}
+
+template <typename Table, typename Options>
+auto SfinaeHashTableUnregister(const Table* table, const Options* options, int)
+    -> decltype(options->RegistryTag(), void()) {
+  HashTableRegistry::Get()->Unregister(table);
+}
+template <typename Table, typename Options>
+void SfinaeHashTableUnregister(const Table*, const Options*, long) {}
+
+// Register "table" in HashTableRegistry if Options defines RegistryTag().
+template <typename Table, typename Options>
+void HashTableRegister(const Table* table, const Options& options) {
+  SfinaeHashTableRegister(table, &options, 0);
+}
+
+// Undo HashTableRegister().
+template <typename Table, typename Options>
+void HashTableUnregister(const Table* table, const Options& options) {
+  SfinaeHashTableUnregister(table, &options, 0);
+}
+
+// One sampled operation on a table whose Options defines
+//
+//   uint32_t SampleEvery() const;
+//
+// If it returns N > 0, one in N find, insert, and erase calls made by a thread
+// is timed and recorded in the thread's HashTableSampleRing. Tables whose
+// Options don't define SampleEvery() compile the sampling away.
+struct HashTableSample {
+  enum Op : uint8_t { FIND, INSERT, ERASE };
+  // For INSERT, HIT means the key already existed, MISS means it was added
+  // without expanding the table, and GROW means the table was expanded.
+  enum Result : uint8_t { HIT, MISS, GROW };
+  Op op;
+  Result result;
+  // Number of slots examined by a find or erase. For an insert, the number of
+  // slots a later find examines to reach the key.
+  int32_t probe_length;
+  // Duration of the operation in HashTableCycles() units.
+  uint64_t cycles;
+};
+
+// Returns a cycle counter: the TSC on x86, nanoseconds elsewhere.
+inline uint64_t HashTableCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Fixed-size buffer of samples written by one thread and drained by another.
+// Push() and Drain() don't block each other. When the ring is full, new
+// samples are dropped and counted.
+class HashTableSampleRing {
+ public:
+  static constexpr size_t kCapacity = 1024;
+
+  // Called only by the thread that owns the ring.
+  void Push(const HashTableSample& sample) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == kCapacity) {
+      num_dropped_.store(num_dropped_.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+      return;
+    }
+    samples_[head % kCapacity] = sample;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Append the samples in the ring to *samples, and remove them from the
+  // ring. Must not be called concurrently with itself.
+  void Drain(std::vector<HashTableSample>* samples) {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    for (uint64_t i = tail; i != head; ++i) {
+      samples->push_back(samples_[i % kCapacity]);
+    }
+    tail_.store(head, std::memory_order_release);
+  }
+
+  uint64_t num_dropped() const {
+    return num_dropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  friend class HashTableSampler;
+
+  HashTableSample samples_[kCapacity];
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+  std::atomic<uint64_t> num_dropped_{0};
+  // True while a thread owns the ring. Guarded by HashTableSampler::mu_.
+  bool in_use_ = false;
+};
+
+// Owner of the per-thread sample rings. A thread claims a ring on its first
+// sampled operation and releases it on exit. Released rings keep their
+// samples until drained, and are reused by later threads, so the number of
+// rings is bounded by the peak number of sampling threads.
+class HashTableSampler {
+ public:
+  static HashTableSampler* Get() {
+    static HashTableSampler* sampler = new HashTableSampler;
+    return sampler;
+  }
+
+  // Returns the ring of the calling thread.
+  static HashTableSampleRing* ThreadRing() {
+    static thread_local ThreadRingHolder holder;
+    return holder.ring;
+  }
+
+  // Append the samples in all the rings to *samples and remove them from the
+  // rings. Returns the number of samples appended.
+  size_t Drain(std::vector<HashTableSample>* samples) {
+    const size_t old_size = samples->size();
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& ring : rings_) ring->Drain(samples);
+    return samples->size() - old_size;
+  }
+
+  // Returns the number of samples dropped because a ring was full.
+  uint64_t NumDropped() const {
+    uint64_t n = 0;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& ring : rings_) n += ring->num_dropped();
+    return n;
+  }
+
+ private:
+  struct ThreadRingHolder {
+    ThreadRingHolder() : ring(Get()->Claim()) {}
+    ~ThreadRingHolder() { Get()->Release(ring); }
+    HashTableSampleRing* ring;
+  };
+
+  HashTableSampleRing* Claim() {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& ring : rings_) {
+      if (!ring->in_use_) {
+        ring->in_use_ = true;
+        return ring.get();
+      }
+    }
+    rings_.emplace_back(new HashTableSampleRing);
+    rings_.back()->in_use_ = true;
+    return rings_.back().get();
+  }
+
+  void Release(HashTableSampleRing* ring) {
+    std::lock_guard<std::mutex> lock(mu_);
+    ring->in_use_ = false;
+  }
+
+  mutable std::mutex mu_;
+  std::vector<std::unique_ptr<HashTableSampleRing>> rings_;
+};
+
+// A template hack to get Options::SampleEvery(), or 0 if it's not defined.
+template <typename Options>
+auto SfinaeSampleEvery(const Options* options, int)
+    -> decltype(options->SampleEvery(), uint32_t()) {
+  return options->SampleEvery();
+}
+template <typename Options>
+uint32_t SfinaeSampleEvery(const Options*, long) {
+  return 0;
+}
+
+// Returns true if the calling thread should sample its next operation on a
+// table with "options". Always false, at compile time, if Options doesn't
+// define SampleEvery().
+template <typename Options>
+bool HashTableShouldSample(const Options& options) {
+  const uint32_t every = SfinaeSampleEvery(&options, 0);
+  if (every == 0) return false;
+  static thread_local uint32_t countdown = 0;
+  if (countdown > 1) {
+    --countdown;
+    return false;
+  }
+  countdown = every;
+  return true;
+}
+
+// Record a sampled operation in the calling thread's ring.
+inline void HashTableRecordSample(HashTableSample::Op op,
+                                  HashTableSample::Result result,
+                                  int probe_length, uint64_t cycles) {
+  HashTableSampler::ThreadRing()->Push(
+      HashTableSample{op, result, probe_length, cycles});
+}
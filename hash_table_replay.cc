@@ -0,0 +1,258 @@
+// Author: yasushi.saito@gmail.com
+//
+// Replays a trace recorded by TracingHashMap (hash_table_trace.h) against
+// several hash table implementations.
+//
+//   hash_table_replay --trace=/tmp/map.trace [--value_size=N]
+//                     [benchmark flags]
+//
+// Each benchmark iteration starts from an empty table and applies every
+// operation in the trace. Keys are the recorded hashes (uint64_t) or the
+// recorded key bytes (std::string), depending on how the trace was written.
+// Values are fixed-size payloads of 8, 32, 128, or 512 bytes: the smallest
+// one that holds the mean recorded value size, or the one that holds N bytes
+// if --value_size is given. The mean recorded size is reported as the
+// "value_bytes" counter, and the payload size as "payload_bytes".
+
+#include <google/dense_hash_map>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "hash_table_trace.h"
+#include "hop_scotch_hash_table.h"
+#include "inlined_hash_table.h"
+
+namespace {
+
+template <typename Key>
+struct ReplayOptions {};
+
+template <>
+struct ReplayOptions<uint64_t> {
+  static constexpr uint64_t kEmptyKey = ~static_cast<uint64_t>(0);
+  static constexpr uint64_t kDeletedKey = kEmptyKey - 1;
+  constexpr uint64_t EmptyKey() const { return kEmptyKey; }
+  constexpr uint64_t DeletedKey() const { return kDeletedKey; }
+};
+
+template <>
+struct ReplayOptions<std::string> {
+  // HashTableCodec never encodes a key as zero bytes, but it may produce any
+  // nonempty byte string. Operations on the deleted key are skipped.
+  static const std::string& EmptyKeyValue() {
+    static const std::string key;
+    return key;
+  }
+  static const std::string& DeletedKeyValue() {
+    static const std::string key("\xff\xff\xff\xff\xff\xff\xff\xff\xff", 9);
+    return key;
+  }
+  const std::string& EmptyKey() const { return EmptyKeyValue(); }
+  const std::string& DeletedKey() const { return DeletedKeyValue(); }
+};
+
+// Stand-in for the recorded values, "kBytes" bytes long.
+template <int kBytes>
+struct ReplayValue {
+  uint64_t words[kBytes / sizeof(uint64_t)] = {};
+};
+
+// The payload sizes, in bytes, that values are rounded up to.
+constexpr int kReplayValueSizes[] = {8, 32, 128, 512};
+
+template <typename Key>
+struct ReplayOp {
+  HashTableTraceRecord::Op op;
+  Key key;
+};
+
+uint64_t ReplayKey(const HashTableTraceRecord& record, uint64_t*) {
+  return record.key_hash;
+}
+std::string ReplayKey(const HashTableTraceRecord& record, std::string*) {
+  return record.key_bytes;
+}
+
+// Convert "records" to operations on keys of type Key. Drops the operations
+// on the keys that the tables reserve. Returns the number of dropped
+// operations.
+template <typename Key>
+size_t ToReplayOps(const std::vector<HashTableTraceRecord>& records,
+                   std::vector<ReplayOp<Key>>* ops) {
+  const ReplayOptions<Key> options;
+  size_t num_dropped = 0;
+  for (const HashTableTraceRecord& record : records) {
+    ReplayOp<Key> op{record.op, ReplayKey(record, static_cast<Key*>(nullptr))};
+    if (op.op != HashTableTraceRecord::kClear &&
+        (op.key == options.EmptyKey() || op.key == options.DeletedKey())) {
+      ++num_dropped;
+      continue;
+    }
+    ops->push_back(std::move(op));
+  }
+  return num_dropped;
+}
+
+template <typename Map>
+Map NewReplayMap() {
+  return Map();
+}
+
+template <typename Key, typename Value>
+using DenseReplayMap = google::dense_hash_map<Key, Value>;
+
+template <typename Map>
+Map NewDenseReplayMap() {
+  using Key = typename Map::key_type;
+  Map m;
+  m.set_empty_key(ReplayOptions<Key>().EmptyKey());
+  m.set_deleted_key(ReplayOptions<Key>().DeletedKey());
+  return m;
+}
+
+template <typename Map, typename Key>
+void BM_Replay(benchmark::State& state, const std::vector<ReplayOp<Key>>* ops,
+               Map (*new_map)(), double value_bytes) {
+  int64_t num_hits = 0;
+  int64_t num_finds = 0;
+  while (state.KeepRunning()) {
+    Map m = new_map();
+    num_hits = 0;
+    num_finds = 0;
+    for (const ReplayOp<Key>& op : *ops) {
+      switch (op.op) {
+        case HashTableTraceRecord::kFind:
+          ++num_finds;
+          if (m.find(op.key) != m.end()) ++num_hits;
+          break;
+        case HashTableTraceRecord::kInsert:
+          ++m[op.key].words[0];
+          break;
+        case HashTableTraceRecord::kErase:
+          m.erase(op.key);
+          break;
+        case HashTableTraceRecord::kClear:
+          m.clear();
+          break;
+      }
+    }
+    benchmark::DoNotOptimize(m.size());
+  }
+  state.SetItemsProcessed(state.iterations() * ops->size());
+  state.counters["find_hit_rate"] =
+      num_finds == 0 ? 0 : static_cast<double>(num_hits) / num_finds;
+  state.counters["value_bytes"] = value_bytes;
+  state.counters["payload_bytes"] = sizeof(typename Map::mapped_type);
+}
+
+template <typename Key, typename Value>
+void RegisterReplayBenchmarks(const std::vector<ReplayOp<Key>>* ops,
+                              double value_bytes) {
+  using Options = ReplayOptions<Key>;
+  using InlinedMap = InlinedHashMap<Key, Value, 8, Options>;
+  using HopScotchMap = HopScotchHashMap<Key, Value, 8>;
+  using UnorderedMap = std::unordered_map<Key, Value>;
+  using DenseMap = DenseReplayMap<Key, Value>;
+  benchmark::RegisterBenchmark("BM_Replay_InlinedMap",
+                               BM_Replay<InlinedMap, Key>, ops,
+                               NewReplayMap<InlinedMap>, value_bytes)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("BM_Replay_HopScotchMap",
+                               BM_Replay<HopScotchMap, Key>, ops,
+                               NewReplayMap<HopScotchMap>, value_bytes)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("BM_Replay_UnorderedMap",
+                               BM_Replay<UnorderedMap, Key>, ops,
+                               NewReplayMap<UnorderedMap>, value_bytes)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("BM_Replay_DenseHashMap",
+                               BM_Replay<DenseMap, Key>, ops,
+                               NewDenseReplayMap<DenseMap>, value_bytes)
+      ->Unit(benchmark::kMillisecond);
+}
+
+// Register the benchmarks with the smallest payload that holds
+// "payload_bytes".
+template <typename Key>
+void RegisterReplayBenchmarks(const std::vector<ReplayOp<Key>>* ops,
+                              double value_bytes, double payload_bytes) {
+  if (payload_bytes <= kReplayValueSizes[0]) {
+    RegisterReplayBenchmarks<Key, ReplayValue<kReplayValueSizes[0]>>(
+        ops, value_bytes);
+  } else if (payload_bytes <= kReplayValueSizes[1]) {
+    RegisterReplayBenchmarks<Key, ReplayValue<kReplayValueSizes[1]>>(
+        ops, value_bytes);
+  } else if (payload_bytes <= kReplayValueSizes[2]) {
+    RegisterReplayBenchmarks<Key, ReplayValue<kReplayValueSizes[2]>>(
+        ops, value_bytes);
+  } else {
+    RegisterReplayBenchmarks<Key, ReplayValue<kReplayValueSizes[3]>>(
+        ops, value_bytes);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  const char* trace_path = nullptr;
+  double payload_bytes = -1;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--trace=", 8) == 0) trace_path = argv[i] + 8;
+    if (strncmp(argv[i], "--value_size=", 13) == 0) {
+      payload_bytes = atof(argv[i] + 13);
+    }
+  }
+  if (trace_path == nullptr) {
+    fprintf(stderr,
+            "Usage: %s --trace=PATH [--value_size=N] [benchmark flags]\n",
+            argv[0]);
+    return 1;
+  }
+  std::ifstream in(trace_path, std::ios::binary);
+  HashTableTraceHeader header;
+  std::vector<HashTableTraceRecord> records;
+  if (!ReadHashTableTrace(&in, &header, &records)) {
+    fprintf(stderr, "%s: not a valid trace\n", trace_path);
+    return 1;
+  }
+
+  uint64_t total_value_bytes = 0;
+  uint64_t num_inserts = 0;
+  for (const HashTableTraceRecord& record : records) {
+    if (record.op != HashTableTraceRecord::kInsert) continue;
+    total_value_bytes += record.value_size;
+    ++num_inserts;
+  }
+  const double value_bytes =
+      num_inserts == 0 ? 0
+                       : static_cast<double>(total_value_bytes) / num_inserts;
+  fprintf(stderr, "%s: %zu operations, %.1f value bytes per insert\n",
+          trace_path, records.size(), value_bytes);
+  if (payload_bytes < 0) payload_bytes = value_bytes;
+
+  std::vector<ReplayOp<uint64_t>> hash_ops;
+  std::vector<ReplayOp<std::string>> bytes_ops;
+  size_t num_dropped;
+  if (header.key_format == HashTableTraceHeader::kKeyHash) {
+    num_dropped = ToReplayOps(records, &hash_ops);
+    RegisterReplayBenchmarks(&hash_ops, value_bytes, payload_bytes);
+  } else {
+    num_dropped = ToReplayOps(records, &bytes_ops);
+    RegisterReplayBenchmarks(&bytes_ops, value_bytes, payload_bytes);
+  }
+  if (num_dropped > 0) {
+    fprintf(stderr, "Dropped %zu operations on reserved keys\n", num_dropped);
+  }
+  records.clear();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,555 @@
+// Author: yasushi.saito@gmail.com
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "hop_scotch_hash_table.h"
+#include "inlined_hash_table.h"
+
+// Streaming binary format for InlinedHashMap and HopScotchHashMap with
+// arbitrary (e.g., std::string) keys and values. For trivially copyable
+// elements, hash_table_snapshot.h is faster.
+//
+// The stream records the capacity of the table and the position of every
+// element, so DeserializeHashTable() restores the exact bucket layout without
+// moving any element. The payload is read into one buffer with a single
+// read() call and the elements are parsed from there.
+//
+// Stream layout:
+//
+//   HashTableStreamHeader
+//   Records, in bucket-index order. For InlinedHashMap:
+//     uint64_t index
+//     uint8_t  kind (kLive or kTombstone)
+//     element, if kind == kLive
+//   For HopScotchHashMap:
+//     uint64_t index
+//     uint8_t  distance from the bucket the key hashes to
+//     element
+//
+// Elements are encoded by HashTableCodec. Integers are stored in the native
+// byte order.
+//
+// The header is validated before anything is allocated for it: the payload
+// must fit in the rest of the stream, and the capacity must be plausible for
+// the number of records (see HashTableStreamMaxCapacity()). An InlinedHashMap
+// stream also carries a fingerprint of the writer's Hash and Options, since
+// the slot positions are meaningless under a different hash.
+//
+// By default, the records are validated too: an InlinedHashMap reader rejects
+// reserved keys and checks that a lookup of every key finds it in its slot,
+// and a HopScotchHashMap reader checks the hop distance of every element.
+// That hashes every key, once or twice, which can cost as much as inserting
+// the elements. Pass HashTableStreamCheck::kTrusted for streams that can't be
+// corrupt or come from a table with another Hash, e.g., ones the same binary
+// wrote, to skip the validation and load without hashing. (An InlinedHashMap
+// with overflow bits still hashes every key once to rebuild them.)
+
+// How much DeserializeHashTable() checks the records of a stream. The header
+// is checked either way.
+enum class HashTableStreamCheck {
+  // Check that every element can be looked up. Rehashes every key.
+  kVerify,
+  // Trust the records. Loads without hashing.
+  kTrusted,
+};
+
+// HashTableCodec<T> defines how a key or a value of type T is encoded. The
+// default implementation copies the bytes of trivially copyable types.
+// std::string is stored as a uint32_t length followed by the bytes, and
+// std::pair as the two fields back to back. Specialize it to support other
+// types.
+//
+// A specialization defines Size(), Write(), and either Read(), which parses
+// into a default-constructed value, or ReadNew(), which constructs the value
+// in uninitialized storage. Only ReadNew() works for types without a default
+// constructor.
+template <typename T, typename Enable = void>
+struct HashTableCodec {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Specialize HashTableCodec for this type");
+  static size_t Size(const T&) { return sizeof(T); }
+  static void Write(const T& v, std::ostream* out) {
+    out->write(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+  // Parse a value at *p and advance *p. Returns false if the data is
+  // truncated.
+  static bool Read(const char** p, const char* limit, T* v) {
+    if (static_cast<size_t>(limit - *p) < sizeof(T)) return false;
+    memcpy(v, *p, sizeof(T));
+    *p += sizeof(T);
+    return true;
+  }
+  // Like Read(), but constructs the value in "storage", which must be
+  // suitably aligned and uninitialized. On failure, "storage" is left
+  // uninitialized.
+  static bool ReadNew(const char** p, const char* limit, void* storage) {
+    return Read(p, limit, static_cast<T*>(storage));
+  }
+};
+
+// Construct a T parsed from *p in "storage" using HashTableCodec<T>::ReadNew(),
+// or, if the codec defines only Read(), by parsing into a default-constructed
+// T. Returns false, leaving "storage" uninitialized, if the data is truncated
+// or malformed.
+template <typename T>
+auto HashTableCodecReadNew(const char** p, const char* limit, void* storage,
+                           int)
+    -> decltype(HashTableCodec<T>::ReadNew(p, limit, storage)) {
+  return HashTableCodec<T>::ReadNew(p, limit, storage);
+}
+
+template <typename T>
+bool HashTableCodecReadNew(const char** p, const char* limit, void* storage,
+                           long) {
+  T* v = new (storage) T();
+  if (HashTableCodec<T>::Read(p, limit, v)) return true;
+  v->~T();
+  return false;
+}
+
+template <>
+struct HashTableCodec<std::string> {
+  static size_t Size(const std::string& v) {
+    return sizeof(uint32_t) + v.size();
+  }
+  static void Write(const std::string& v, std::ostream* out) {
+    HashTableCodec<uint32_t>::Write(v.size(), out);
+    out->write(v.data(), v.size());
+  }
+  static bool Read(const char** p, const char* limit, std::string* v) {
+    uint32_t n;
+    if (!HashTableCodec<uint32_t>::Read(p, limit, &n)) return false;
+    if (static_cast<size_t>(limit - *p) < n) return false;
+    v->assign(*p, n);
+    *p += n;
+    return true;
+  }
+  static bool ReadNew(const char** p, const char* limit, void* storage) {
+    std::string v;
+    if (!Read(p, limit, &v)) return false;
+    new (storage) std::string(std::move(v));
+    return true;
+  }
+};
+
+template <typename T0, typename T1>
+struct HashTableCodec<std::pair<T0, T1>> {
+  static size_t Size(const std::pair<T0, T1>& v) {
+    return HashTableCodec<T0>::Size(v.first) +
+           HashTableCodec<T1>::Size(v.second);
+  }
+  static void Write(const std::pair<T0, T1>& v, std::ostream* out) {
+    HashTableCodec<T0>::Write(v.first, out);
+    HashTableCodec<T1>::Write(v.second, out);
+  }
+  static bool Read(const char** p, const char* limit, std::pair<T0, T1>* v) {
+    return HashTableCodec<T0>::Read(p, limit, &v->first) &&
+           HashTableCodec<T1>::Read(p, limit, &v->second);
+  }
+  static bool ReadNew(const char** p, const char* limit, void* storage) {
+    typename std::aligned_storage<sizeof(T0), alignof(T0)>::type first;
+    typename std::aligned_storage<sizeof(T1), alignof(T1)>::type second;
+    if (!HashTableCodecReadNew<T0>(p, limit, &first, 0)) return false;
+    T0* v0 = reinterpret_cast<T0*>(&first);
+    if (!HashTableCodecReadNew<T1>(p, limit, &second, 0)) {
+      v0->~T0();
+      return false;
+    }
+    T1* v1 = reinterpret_cast<T1*>(&second);
+    new (storage) std::pair<T0, T1>(std::move(*v0), std::move(*v1));
+    v0->~T0();
+    v1->~T1();
+    return true;
+  }
+};
+
+constexpr char kHashTableStreamMagic[8] = {'I', 'H', 'T', 'S',
+                                           'T', 'R', 'M', '\0'};
+constexpr uint32_t kHashTableStreamVersion = 2;
+// Size of the smallest record: the index and the kind or the distance.
+constexpr uint64_t kHashTableStreamMinRecordBytes =
+    sizeof(uint64_t) + sizeof(uint8_t);
+
+struct HashTableStreamHeader {
+  enum TableType : uint32_t { kInlinedHashTable = 1, kHopScotchHashTable = 2 };
+  enum RecordKind : uint8_t { kLive = 0, kTombstone = 1 };
+
+  char magic[8];
+  uint32_t version;
+  uint32_t table_type;
+  // HashTableStreamFingerprint() for InlinedHashTable. Zero for
+  // HopScotchHashTable.
+  uint64_t fingerprint;
+  // Number of slots. Zero or a power of two.
+  uint64_t capacity;
+  // Number of live elements.
+  uint64_t size;
+  // InlinedHashTable::NumFreeSlots(). Unused for HopScotchHashTable.
+  uint64_t num_free_slots;
+  // Number of records following the header.
+  uint64_t num_records;
+  // Total size of the records, in bytes.
+  uint64_t payload_bytes;
+
+  void Init(TableType type) {
+    memset(this, 0, sizeof(*this));
+    memcpy(magic, kHashTableStreamMagic, sizeof(magic));
+    version = kHashTableStreamVersion;
+    table_type = type;
+  }
+
+  bool IsValid(TableType type) const {
+    return memcmp(magic, kHashTableStreamMagic, sizeof(magic)) == 0 &&
+           version == kHashTableStreamVersion && table_type == type &&
+           (capacity & (capacity - 1)) == 0;
+  }
+};
+
+template <typename Key, typename Hash>
+void WriteHashTableStreamFingerprintKey(const Key& k, const Hash& hash,
+                                        std::ostream* out) {
+  HashTableCodec<Key>::Write(k, out);
+  HashTableCodec<uint64_t>::Write(hash(k), out);
+}
+
+// A template hack to fingerprint Options::DeletedKey only when it's defined.
+template <typename Key, typename Options, typename Hash>
+auto SfinaeWriteHashTableStreamDeletedKey(const Options* options,
+                                          const Hash& hash, std::ostream* out,
+                                          int)
+    -> decltype(options->DeletedKey(), void()) {
+  WriteHashTableStreamFingerprintKey<Key>(options->DeletedKey(), hash, out);
+}
+
+template <typename Key, typename Options, typename Hash>
+void SfinaeWriteHashTableStreamDeletedKey(const Options*, const Hash&,
+                                          std::ostream*, long) {}
+
+// Compute a digest of the parameters that decide where InlinedHashTable
+// places the keys: the encodings and the hashes of the empty key and the
+// deleted key. Like HashTableSnapshotFingerprint(), it can't detect every
+// change in Hash.
+template <typename Key, typename Options, typename Hash>
+uint64_t HashTableStreamFingerprint(const Options& options, const Hash& hash) {
+  std::ostringstream data;
+  WriteHashTableStreamFingerprintKey<Key>(options.EmptyKey(), hash, &data);
+  SfinaeWriteHashTableStreamDeletedKey<Key>(&options, hash, &data, 0);
+  // FNV-1a.
+  uint64_t fp = 14695981039346656037ULL;
+  for (char c : data.str()) {
+    fp = (fp ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+  }
+  return fp;
+}
+
+// Returns the largest capacity DeserializeHashTable() accepts for a table of
+// "num_records" records, which fills "max_load_factor" of its slots before it
+// grows. This bounds the memory a corrupt header can make the reader
+// allocate. SerializeHashTable() writes a rehashed copy of a table that is
+// sparser than this, e.g., after clear().
+inline uint64_t HashTableStreamMaxCapacity(uint64_t num_records,
+                                           double max_load_factor,
+                                           uint64_t min_capacity) {
+  const double n = 16.0 * (num_records + 1.0) / max_load_factor;
+  const uint64_t max_capacity = n >= std::ldexp(1.0, 64)
+                                    ? std::numeric_limits<uint64_t>::max()
+                                    : static_cast<uint64_t>(n);
+  return std::max<uint64_t>({min_capacity, 64, max_capacity});
+}
+
+// Read "header" and the payload that follows it from "in". Returns false on
+// error, or if the stream wasn't written for a table of "type". Fails without
+// allocating the payload if payload_bytes exceeds the rest of the stream.
+inline bool ReadHashTableStream(std::istream* in,
+                                HashTableStreamHeader::TableType type,
+                                HashTableStreamHeader* header,
+                                std::string* payload) {
+  if (!in->read(reinterpret_cast<char*>(header), sizeof(*header)) ||
+      !header->IsValid(type) ||
+      header->num_records >
+          header->payload_bytes / kHashTableStreamMinRecordBytes ||
+      header->payload_bytes > payload->max_size()) {
+    return false;
+  }
+  const size_t n = header->payload_bytes;
+  const std::streampos pos = in->tellg();
+  if (pos != std::streampos(-1)) {
+    in->seekg(0, std::ios::end);
+    const std::streampos end = in->tellg();
+    in->seekg(pos);
+    if (!*in || end < pos || static_cast<uint64_t>(end - pos) < n) {
+      return false;
+    }
+    payload->resize(n);
+    return n == 0 || static_cast<bool>(in->read(&(*payload)[0], n));
+  }
+  // "in" isn't seekable, e.g., it's a pipe. Read the payload in chunks, so
+  // that a bogus payload_bytes runs into the end of the stream before it
+  // runs out of memory.
+  constexpr size_t kChunkBytes = 1 << 20;
+  payload->clear();
+  while (payload->size() < n) {
+    const size_t offset = payload->size();
+    const size_t chunk = std::min(kChunkBytes, n - offset);
+    payload->resize(offset + chunk);
+    if (!in->read(&(*payload)[offset], chunk)) return false;
+  }
+  return true;
+}
+
+// Write the contents of "map" to "out". Returns false on I/O error.
+template <typename Key, typename Value, int NumInlinedElements,
+          typename Options, typename Hash, typename EqualTo,
+          typename IndexType>
+bool SerializeHashTable(
+    const InlinedHashMap<Key, Value, NumInlinedElements, Options, Hash, EqualTo,
+                         IndexType>& map,
+    std::ostream* out) {
+  using Map = InlinedHashMap<Key, Value, NumInlinedElements, Options, Hash,
+                             EqualTo, IndexType>;
+  using Elem = typename Map::value_type;
+  const auto& table = map.table();
+  HashTableStreamHeader header;
+  header.Init(HashTableStreamHeader::kInlinedHashTable);
+  header.fingerprint =
+      HashTableStreamFingerprint<Key>(table.options(), table.hash());
+  header.capacity = table.Capacity();
+  header.size = table.Size();
+  header.num_free_slots = table.NumFreeSlots();
+  for (IndexType i = 0; i < table.Capacity(); ++i) {
+    if (table.IsEmptySlot(i)) continue;
+    ++header.num_records;
+    header.payload_bytes += sizeof(uint64_t) + sizeof(uint8_t);
+    if (!table.IsTombstoneSlot(i)) {
+      header.payload_bytes += HashTableCodec<Elem>::Size(table.GetElem(i));
+    }
+  }
+  const uint64_t max_capacity = HashTableStreamMaxCapacity(
+      header.num_records, table.MaxLoadFactor(), NumInlinedElements);
+  if (header.capacity > max_capacity) {
+    // The table is much larger than its elements need. Write a rehashed copy
+    // that DeserializeHashTable() accepts.
+    Map compact(map.size(), table.options(), table.hash(), table.equal_to());
+    for (const Elem& elem : map) compact.insert(elem);
+    if (compact.capacity() > max_capacity) return false;
+    return SerializeHashTable(compact, out);
+  }
+  out->write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (IndexType i = 0; i < table.Capacity(); ++i) {
+    if (table.IsEmptySlot(i)) continue;
+    HashTableCodec<uint64_t>::Write(i, out);
+    if (table.IsTombstoneSlot(i)) {
+      HashTableCodec<uint8_t>::Write(HashTableStreamHeader::kTombstone, out);
+    } else {
+      HashTableCodec<uint8_t>::Write(HashTableStreamHeader::kLive, out);
+      HashTableCodec<Elem>::Write(table.GetElem(i), out);
+    }
+  }
+  return out->good();
+}
+
+// Replace the contents of "map" with the table stored in "in". Returns false
+// if the stream is truncated or malformed, in which case "map" is left empty.
+// "check" tells how much of the stream is validated.
+template <typename Key, typename Value, int NumInlinedElements,
+          typename Options, typename Hash, typename EqualTo,
+          typename IndexType>
+bool DeserializeHashTable(
+    std::istream* in,
+    InlinedHashMap<Key, Value, NumInlinedElements, Options, Hash, EqualTo,
+                   IndexType>* map,
+    HashTableStreamCheck check = HashTableStreamCheck::kVerify) {
+  using Elem = typename InlinedHashMap<Key, Value, NumInlinedElements, Options,
+                                       Hash, EqualTo, IndexType>::value_type;
+  auto* table = map->mutable_table();
+  table->ResetCapacity(NumInlinedElements);
+  const bool verify = check == HashTableStreamCheck::kVerify;
+
+  HashTableStreamHeader header;
+  std::string payload;
+  if (!ReadHashTableStream(in, HashTableStreamHeader::kInlinedHashTable,
+                           &header, &payload) ||
+      header.fingerprint !=
+          HashTableStreamFingerprint<Key>(table->options(), table->hash()) ||
+      header.capacity < NumInlinedElements ||
+      header.capacity > std::numeric_limits<IndexType>::max() ||
+      header.capacity > HashTableStreamMaxCapacity(header.num_records,
+                                                   table->MaxLoadFactor(),
+                                                   NumInlinedElements) ||
+      header.size > header.num_records) {
+    return false;
+  }
+  // Live elements and free slots can't exceed the slots the table fills
+  // before it grows.
+  const uint64_t usable_slots = static_cast<IndexType>(
+      static_cast<IndexType>(header.capacity) * table->MaxLoadFactor());
+  if (header.num_free_slots > usable_slots ||
+      header.size > usable_slots - header.num_free_slots) {
+    return false;
+  }
+  table->ResetCapacity(header.capacity);
+  const char* p = payload.data();
+  const char* limit = p + payload.size();
+  for (uint64_t r = 0; r < header.num_records; ++r) {
+    uint64_t index;
+    uint8_t kind;
+    if (!HashTableCodec<uint64_t>::Read(&p, limit, &index) ||
+        !HashTableCodec<uint8_t>::Read(&p, limit, &kind) ||
+        index >= header.capacity || !table->IsEmptySlot(index)) {
+      table->ResetCapacity(NumInlinedElements);
+      return false;
+    }
+    if (kind == HashTableStreamHeader::kTombstone) {
+      if (!table->RestoreTombstone(index)) {
+        table->ResetCapacity(NumInlinedElements);
+        return false;
+      }
+      continue;
+    }
+    typename std::aligned_storage<sizeof(Elem), alignof(Elem)>::type storage;
+    if (kind != HashTableStreamHeader::kLive ||
+        !HashTableCodecReadNew<Elem>(&p, limit, &storage, 0)) {
+      table->ResetCapacity(NumInlinedElements);
+      return false;
+    }
+    Elem* elem = reinterpret_cast<Elem*>(&storage);
+    const bool ok = table->RestoreElem(index, std::move(*elem), verify);
+    elem->~Elem();
+    if (!ok) {
+      table->ResetCapacity(NumInlinedElements);
+      return false;
+    }
+  }
+  if (table->Size() != header.size) {
+    table->ResetCapacity(NumInlinedElements);
+    return false;
+  }
+  // RestoreElem() checked that each key's slot is on its probe sequence. A
+  // lookup must also reach it, i.e., no empty slot or other copy of the key
+  // may come first.
+  for (IndexType i = 0; verify && i < table->Capacity(); ++i) {
+    if (table->IsEmptySlot(i) || table->IsTombstoneSlot(i)) continue;
+    const Key& key = table->GetElem(i).first;
+    IndexType found;
+    if (!table->Find(key, table->hash()(key), &found) || found != i) {
+      table->ResetCapacity(NumInlinedElements);
+      return false;
+    }
+  }
+  table->RestoreNumFreeSlots(header.num_free_slots);
+  return true;
+}
+
+// Write the contents of "map" to "out". Returns false on I/O error.
+template <typename Key, typename Value, int NumInlinedBuckets, typename Hash,
+          typename EqualTo, typename IndexType, typename Options>
+bool SerializeHashTable(
+    const HopScotchHashMap<Key, Value, NumInlinedBuckets, Hash, EqualTo,
+                           IndexType, Options>& map,
+    std::ostream* out) {
+  using Map = HopScotchHashMap<Key, Value, NumInlinedBuckets, Hash, EqualTo,
+                               IndexType, Options>;
+  using Elem = typename Map::value_type;
+  const auto& table = map.table();
+  HashTableStreamHeader header;
+  header.Init(HashTableStreamHeader::kHopScotchHashTable);
+  header.capacity = table.capacity();
+  header.size = table.size();
+  header.num_records = table.size();
+  for (IndexType i = 0; i < table.capacity(); ++i) {
+    const auto& bucket = table.GetBucket(i);
+    if (!bucket.md.IsOccupied()) continue;
+    header.payload_bytes += sizeof(uint64_t) + sizeof(uint8_t) +
+                            HashTableCodec<Elem>::Size(bucket.value.Get());
+  }
+  const uint64_t max_capacity =
+      HashTableStreamMaxCapacity(header.num_records, 1.0, NumInlinedBuckets);
+  if (header.capacity > max_capacity) {
+    // The table is much larger than its elements need. Write a rehashed copy
+    // that DeserializeHashTable() accepts.
+    Map compact(map.size(), table.hash(), table.equal_to(), table.options());
+    for (const Elem& elem : map) compact.insert(elem);
+    if (compact.capacity() > max_capacity) return false;
+    return SerializeHashTable(compact, out);
+  }
+  out->write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (IndexType i = 0; i < table.capacity(); ++i) {
+    const auto& bucket = table.GetBucket(i);
+    if (!bucket.md.IsOccupied()) continue;
+    HashTableCodec<uint64_t>::Write(i, out);
+    HashTableCodec<uint8_t>::Write(table.HopDistance(i), out);
+    HashTableCodec<Elem>::Write(bucket.value.Get(), out);
+  }
+  return out->good();
+}
+
+// Replace the contents of "map" with the table stored in "in". Returns false
+// if the stream is truncated or malformed, in which case "map" is left empty.
+// "check" tells how much of the stream is validated.
+template <typename Key, typename Value, int NumInlinedBuckets, typename Hash,
+          typename EqualTo, typename IndexType, typename Options>
+bool DeserializeHashTable(
+    std::istream* in,
+    HopScotchHashMap<Key, Value, NumInlinedBuckets, Hash, EqualTo, IndexType,
+                     Options>* map,
+    HashTableStreamCheck check = HashTableStreamCheck::kVerify) {
+  using Elem = typename HopScotchHashMap<Key, Value, NumInlinedBuckets, Hash,
+                                         EqualTo, IndexType,
+                                         Options>::value_type;
+  auto* table = map->mutable_table();
+  table->ResetCapacity(NumInlinedBuckets);
+
+  HashTableStreamHeader header;
+  std::string payload;
+  if (!ReadHashTableStream(in, HashTableStreamHeader::kHopScotchHashTable,
+                           &header, &payload) ||
+      header.capacity < NumInlinedBuckets ||
+      header.capacity > std::numeric_limits<IndexType>::max() ||
+      header.capacity > HashTableStreamMaxCapacity(header.num_records, 1.0,
+                                                   NumInlinedBuckets) ||
+      header.size != header.num_records) {
+    return false;
+  }
+  table->ResetCapacity(header.capacity);
+  const char* p = payload.data();
+  const char* limit = p + payload.size();
+  for (uint64_t r = 0; r < header.num_records; ++r) {
+    uint64_t index;
+    uint8_t distance;
+    typename std::aligned_storage<sizeof(Elem), alignof(Elem)>::type storage;
+    if (!HashTableCodec<uint64_t>::Read(&p, limit, &index) ||
+        !HashTableCodec<uint8_t>::Read(&p, limit, &distance) ||
+        !HashTableCodecReadNew<Elem>(&p, limit, &storage, 0)) {
+      table->ResetCapacity(NumInlinedBuckets);
+      return false;
+    }
+    Elem* elem = reinterpret_cast<Elem*>(&storage);
+    const bool ok = table->RestoreValue(index, distance, std::move(*elem));
+    elem->~Elem();
+    // The stream has no fingerprint of Hash; check that the key still hashes
+    // to the bucket the writer saw.
+    if (!ok || (check == HashTableStreamCheck::kVerify &&
+                table->HopDistance(index) != distance)) {
+      table->ResetCapacity(NumInlinedBuckets);
+      return false;
+    }
+  }
+  if (table->size() != header.size) {
+    table->ResetCapacity(NumInlinedBuckets);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,265 @@
+// Author: yasushi.saito@gmail.com
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "inlined_hash_table.h"
+
+// On-disk snapshot of an InlinedHashMap whose elements are trivially copyable,
+// e.g., InlinedHashMap<int64_t, int64_t, ...>.
+//
+// WriteHashTableSnapshot() dumps the bucket array, with the values of empty
+// slots and tombstones zeroed, and
+// InlinedHashMapSnapshot mmaps the file and answers find() directly from the
+// mapped pages. Opening a snapshot is O(1), and processes that open the same
+// file share the page cache.
+//
+// File layout:
+//
+//   HashTableSnapshotHeader, padded to kHashTableSnapshotHeaderSize bytes.
+//   Elem slots[capacity], in bucket-index order.
+//
+// The slots are stored in the native byte order and struct layout, so a
+// snapshot can be read only by a binary built for the same architecture with
+// the same Key, Value, Options and Hash. The options fingerprint guards
+// against accidental mismatches, but it can't detect every change in Hash.
+
+constexpr char kHashTableSnapshotMagic[8] = {'I', 'H', 'T', 'S',
+                                             'N', 'A', 'P', '\0'};
+constexpr uint32_t kHashTableSnapshotVersion = 1;
+constexpr size_t kHashTableSnapshotHeaderSize = 64;
+
+struct HashTableSnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  // sizeof(Elem)
+  uint32_t elem_size;
+  // Value of HashTableSnapshotFingerprint().
+  uint64_t fingerprint;
+  // Number of slots. Zero or a power of two.
+  uint64_t capacity;
+  // Number of live elements.
+  uint64_t size;
+  // InlinedHashTable::NumFreeSlots().
+  uint64_t num_free_slots;
+};
+static_assert(sizeof(HashTableSnapshotHeader) <= kHashTableSnapshotHeaderSize,
+              "HashTableSnapshotHeader too large");
+
+// Compute a digest of the parameters that affect lookups in the snapshot: the
+// element layout, the empty key, and the hash of the empty key.
+template <typename Key, typename Elem, typename Options, typename Hash>
+uint64_t HashTableSnapshotFingerprint(const Options& options,
+                                      const Hash& hash) {
+  // FNV-1a.
+  uint64_t fp = 14695981039346656037ULL;
+  auto mix = [&fp](const void* data, size_t n) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < n; ++i) {
+      fp = (fp ^ p[i]) * 1099511628211ULL;
+    }
+  };
+  const uint64_t sizes[] = {sizeof(Key), sizeof(Elem), alignof(Elem)};
+  mix(sizes, sizeof(sizes));
+  const Key empty_key = options.EmptyKey();
+  mix(&empty_key, sizeof(empty_key));
+  const uint64_t empty_hash = hash(empty_key);
+  mix(&empty_hash, sizeof(empty_hash));
+  return fp;
+}
+
+// Write the contents of "map" to "path". The file is first written to a
+// temporary file and then renamed, so readers never observe a partial
+// snapshot. Returns false on I/O error.
+template <typename Key, typename Value, int NumInlinedElements,
+          typename Options, typename Hash, typename EqualTo,
+          typename IndexType>
+bool WriteHashTableSnapshot(
+    const InlinedHashMap<Key, Value, NumInlinedElements, Options, Hash, EqualTo,
+                         IndexType>& map,
+    const std::string& path) {
+  using Map = InlinedHashMap<Key, Value, NumInlinedElements, Options, Hash,
+                             EqualTo, IndexType>;
+  using Elem = typename Map::value_type;
+  static_assert(std::is_trivially_copyable<Key>::value &&
+                    std::is_trivially_copyable<Value>::value,
+                "Snapshots require trivially copyable keys and values");
+  static_assert(alignof(Elem) <= kHashTableSnapshotHeaderSize,
+                "Element alignment too large");
+  const typename Map::Table& table = map.table();
+
+  char buf[kHashTableSnapshotHeaderSize];
+  memset(buf, 0, sizeof(buf));
+  HashTableSnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kHashTableSnapshotMagic, sizeof(header.magic));
+  header.version = kHashTableSnapshotVersion;
+  header.elem_size = sizeof(Elem);
+  header.fingerprint =
+      HashTableSnapshotFingerprint<Key, Elem>(table.options(), table.hash());
+  header.capacity = table.Capacity();
+  header.size = table.Size();
+  header.num_free_slots = table.NumFreeSlots();
+  memcpy(buf, &header, sizeof(header));
+
+  const std::string tmp_path = path + ".tmp";
+  FILE* fp = fopen(tmp_path.c_str(), "wb");
+  if (fp == nullptr) return false;
+  bool ok = fwrite(buf, sizeof(buf), 1, fp) == 1;
+  // Copy the slots field by field into a zeroed buffer, so that the file
+  // doesn't capture the uninitialized values of empty slots and tombstones,
+  // or the padding between Key and Value.
+  constexpr size_t kBatchSlots = 1024;
+  const size_t capacity = table.Capacity();
+  std::vector<char> batch(std::min(capacity, kBatchSlots) * sizeof(Elem));
+  for (size_t start = 0; ok && start < capacity; start += kBatchSlots) {
+    const size_t n = std::min(capacity - start, kBatchSlots);
+    memset(batch.data(), 0, n * sizeof(Elem));
+    for (size_t j = 0; j < n; ++j) {
+      const Elem& elem = table.GetElem(start + j);
+      const char* base = reinterpret_cast<const char*>(&elem);
+      char* slot = batch.data() + j * sizeof(Elem);
+      memcpy(slot + (reinterpret_cast<const char*>(&elem.first) - base),
+             &elem.first, sizeof(Key));
+      if (table.IsEmptySlot(start + j) || table.IsTombstoneSlot(start + j)) {
+        continue;
+      }
+      memcpy(slot + (reinterpret_cast<const char*>(&elem.second) - base),
+             &elem.second, sizeof(Value));
+    }
+    ok = fwrite(batch.data(), sizeof(Elem), n, fp) == n;
+  }
+  if (fclose(fp) != 0) ok = false;
+  if (ok && rename(tmp_path.c_str(), path.c_str()) != 0) ok = false;
+  if (!ok) unlink(tmp_path.c_str());
+  return ok;
+}
+
+// Read-only view of a file created by WriteHashTableSnapshot(). The template
+// parameters must match those of the InlinedHashMap that wrote the
+// snapshot. NumInlinedElements and IndexType don't matter, since the view
+// doesn't distinguish inlined and outlined slots.
+//
+// Example:
+//
+//   InlinedHashMapSnapshot<int64_t, int64_t, Options> snapshot;
+//   if (!snapshot.Open("/path/to/file")) abort();
+//   const auto* elem = snapshot.find(10);
+//   if (elem != nullptr) printf("%ld\n", elem->second);
+template <typename Key, typename Value, typename Options,
+          typename Hash = std::hash<Key>, typename EqualTo = std::equal_to<Key>>
+class InlinedHashMapSnapshot {
+ public:
+  using Elem = std::pair<Key, Value>;
+  using value_type = Elem;
+  static_assert(std::is_trivially_copyable<Key>::value &&
+                    std::is_trivially_copyable<Value>::value,
+                "Snapshots require trivially copyable keys and values");
+
+  InlinedHashMapSnapshot(const Options& options = Options(),
+                         const Hash& hash = Hash(),
+                         const EqualTo& equal_to = EqualTo())
+      : options_(options), hash_(hash), equal_to_(equal_to) {}
+  ~InlinedHashMapSnapshot() { Close(); }
+
+  // Map the snapshot file. Returns false if the file can't be read, or if it
+  // was written with incompatible parameters.
+  bool Open(const std::string& path) {
+    Close();
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < kHashTableSnapshotHeaderSize) {
+      close(fd);
+      return false;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    mapped_ = addr;
+    mapped_size_ = st.st_size;
+
+    HashTableSnapshotHeader header;
+    memcpy(&header, mapped_, sizeof(header));
+    if (memcmp(header.magic, kHashTableSnapshotMagic, sizeof(header.magic)) !=
+            0 ||
+        header.version != kHashTableSnapshotVersion ||
+        header.elem_size != sizeof(Elem) ||
+        header.fingerprint !=
+            HashTableSnapshotFingerprint<Key, Elem>(options_, hash_) ||
+        (header.capacity & (header.capacity - 1)) != 0 ||
+        header.capacity >
+            (mapped_size_ - kHashTableSnapshotHeaderSize) / sizeof(Elem) ||
+        mapped_size_ !=
+            kHashTableSnapshotHeaderSize + header.capacity * sizeof(Elem)) {
+      Close();
+      return false;
+    }
+    capacity_mask_ = header.capacity - 1;
+    size_ = header.size;
+    slots_ = reinterpret_cast<const Elem*>(static_cast<const char*>(mapped_) +
+                                           kHashTableSnapshotHeaderSize);
+    return true;
+  }
+
+  // Unmap the file. Pointers returned by find() become invalid.
+  void Close() {
+    if (mapped_ != nullptr) munmap(mapped_, mapped_size_);
+    mapped_ = nullptr;
+    mapped_size_ = 0;
+    slots_ = nullptr;
+    capacity_mask_ = static_cast<size_t>(-1);
+    size_ = 0;
+  }
+
+  // Returns the element with key "k", or nullptr if not found.
+  const Elem* find(const Key& k) const {
+    if (Capacity() == 0) return nullptr;
+    // The probe sequence must match InlinedHashTable::Find.
+    size_t index = hash_(k) & capacity_mask_;
+    for (size_t retries = 1;; ++retries) {
+      const Elem& elem = slots_[index];
+      if (equal_to_(elem.first, k)) {
+        return &elem;
+      } else if (equal_to_(options_.EmptyKey(), elem.first)) {
+        return nullptr;
+      }
+      if (retries > Capacity()) {
+        return nullptr;
+      }
+      index = (index + retries) & capacity_mask_;
+    }
+  }
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+  size_t capacity() const { return Capacity(); }
+
+ private:
+  InlinedHashMapSnapshot(const InlinedHashMapSnapshot&) = delete;
+  void operator=(const InlinedHashMapSnapshot&) = delete;
+
+  size_t Capacity() const { return capacity_mask_ + 1; }
+
+  Options options_;
+  Hash hash_;
+  EqualTo equal_to_;
+  void* mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+  const Elem* slots_ = nullptr;
+  size_t capacity_mask_ = static_cast<size_t>(-1);
+  size_t size_ = 0;
+};
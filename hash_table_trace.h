@@ -0,0 +1,247 @@
+// Author: yasushi.saito@gmail.com
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hash_table_serializer.h"
+
+// Records the stream of operations applied to an InlinedHashMap or a
+// HopScotchHashMap, so that it can be replayed against other tables offline
+// (see hash_table_replay.cc).
+//
+// Trace layout:
+//
+//   HashTableTraceHeader
+//   Records, in the order the operations were issued:
+//     uint8_t  op (HashTableTraceRecord::Op)
+//     key, unless op == kClear:
+//       uint64_t hash of the key, if key_format == kKeyHash
+//       uint32_t length and the key encoded by HashTableCodec, if
+//       key_format == kKeyBytes
+//     uint32_t size of the value encoded by HashTableCodec, if op == kInsert
+//
+// kKeyHash keeps the trace small and doesn't leak the keys; kKeyBytes keeps
+// the key sizes and the cost of comparing them. The length prefix lets the
+// trace be read without knowing the key type. Integers are stored in the
+// native byte order.
+
+constexpr char kHashTableTraceMagic[8] = {'I', 'H', 'T', 'T',
+                                          'R', 'A', 'C', 'E'};
+constexpr uint32_t kHashTableTraceVersion = 1;
+
+struct HashTableTraceHeader {
+  enum KeyFormat : uint32_t { kKeyHash = 1, kKeyBytes = 2 };
+
+  char magic[8];
+  uint32_t version;
+  uint32_t key_format;
+
+  void Init(KeyFormat format) {
+    memset(this, 0, sizeof(*this));
+    memcpy(magic, kHashTableTraceMagic, sizeof(magic));
+    version = kHashTableTraceVersion;
+    key_format = format;
+  }
+
+  bool IsValid() const {
+    return memcmp(magic, kHashTableTraceMagic, sizeof(magic)) == 0 &&
+           version == kHashTableTraceVersion &&
+           (key_format == kKeyHash || key_format == kKeyBytes);
+  }
+};
+
+// One operation read back from a trace.
+struct HashTableTraceRecord {
+  // kFind is a lookup, kInsert an insertion or an assignment, and kErase an
+  // erasure by key.
+  enum Op : uint8_t { kFind = 0, kInsert = 1, kErase = 2, kClear = 3 };
+
+  Op op;
+  // Set if the trace's key_format is kKeyHash.
+  uint64_t key_hash = 0;
+  // Set if the trace's key_format is kKeyBytes. The key as encoded by
+  // HashTableCodec.
+  std::string key_bytes;
+  // Set if op == kInsert.
+  uint32_t value_size = 0;
+};
+
+// Writes a trace to a std::ostream. Not thread safe; give each traced table
+// its own writer.
+class HashTableTraceWriter {
+ public:
+  // Write the trace header to "out", which must outlive the writer.
+  HashTableTraceWriter(std::ostream* out,
+                       HashTableTraceHeader::KeyFormat format)
+      : out_(out), format_(format) {
+    HashTableTraceHeader header;
+    header.Init(format);
+    out_->write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+  HashTableTraceHeader::KeyFormat format() const { return format_; }
+
+  // Record an operation on "key", whose hash is "hash". "value_size" is used
+  // only for kInsert.
+  template <typename Key>
+  void Record(HashTableTraceRecord::Op op, const Key& key, uint64_t hash,
+              uint32_t value_size) {
+    HashTableCodec<uint8_t>::Write(op, out_);
+    if (op == HashTableTraceRecord::kClear) return;
+    if (format_ == HashTableTraceHeader::kKeyHash) {
+      HashTableCodec<uint64_t>::Write(hash, out_);
+    } else {
+      HashTableCodec<uint32_t>::Write(HashTableCodec<Key>::Size(key), out_);
+      HashTableCodec<Key>::Write(key, out_);
+    }
+    if (op == HashTableTraceRecord::kInsert) {
+      HashTableCodec<uint32_t>::Write(value_size, out_);
+    }
+  }
+
+  void RecordClear() {
+    HashTableCodec<uint8_t>::Write(HashTableTraceRecord::kClear, out_);
+  }
+
+  // Returns false if writing to the stream has failed.
+  bool ok() const { return out_->good(); }
+
+ private:
+  std::ostream* const out_;
+  const HashTableTraceHeader::KeyFormat format_;
+};
+
+// Read a whole trace from "in". Returns false if the stream is malformed or
+// truncated in the middle of a record.
+inline bool ReadHashTableTrace(std::istream* in, HashTableTraceHeader* header,
+                               std::vector<HashTableTraceRecord>* records) {
+  records->clear();
+  if (!in->read(reinterpret_cast<char*>(header), sizeof(*header)) ||
+      !header->IsValid()) {
+    return false;
+  }
+  const std::string data((std::istreambuf_iterator<char>(*in)),
+                         std::istreambuf_iterator<char>());
+  const char* p = data.data();
+  const char* const limit = p + data.size();
+  while (p < limit) {
+    HashTableTraceRecord record;
+    uint8_t op;
+    if (!HashTableCodec<uint8_t>::Read(&p, limit, &op) ||
+        op > HashTableTraceRecord::kClear) {
+      return false;
+    }
+    record.op = static_cast<HashTableTraceRecord::Op>(op);
+    if (record.op == HashTableTraceRecord::kClear) {
+      // No key.
+    } else if (header->key_format == HashTableTraceHeader::kKeyHash) {
+      if (!HashTableCodec<uint64_t>::Read(&p, limit, &record.key_hash)) {
+        return false;
+      }
+    } else if (!HashTableCodec<std::string>::Read(&p, limit,
+                                                   &record.key_bytes)) {
+      return false;
+    }
+    if (record.op == HashTableTraceRecord::kInsert &&
+        !HashTableCodec<uint32_t>::Read(&p, limit, &record.value_size)) {
+      return false;
+    }
+    records->push_back(std::move(record));
+  }
+  return true;
+}
+
+// Wrapper around InlinedHashMap or HopScotchHashMap that logs every lookup,
+// insertion, and erasure to a HashTableTraceWriter. It exposes the common
+// subset of the map interface; use map() for the rest, bypassing the trace.
+//
+// Operations that return a mutable reference (operator[]) record the size of
+// the value at the time of the call, since later assignments through the
+// reference can't be observed.
+template <typename Map>
+class TracingHashMap {
+ public:
+  using key_type = typename Map::key_type;
+  using mapped_type = typename Map::mapped_type;
+  using value_type = typename Map::value_type;
+  using iterator = typename Map::iterator;
+  using const_iterator = typename Map::const_iterator;
+
+  // "writer" must outlive the wrapper.
+  explicit TracingHashMap(HashTableTraceWriter* writer, Map map = Map())
+      : writer_(writer), map_(std::move(map)) {}
+
+  iterator find(const key_type& k) {
+    Record(HashTableTraceRecord::kFind, k, 0);
+    return map_.find(k);
+  }
+  const_iterator find(const key_type& k) const {
+    Record(HashTableTraceRecord::kFind, k, 0);
+    return map_.find(k);
+  }
+
+  mapped_type& operator[](const key_type& k) {
+    mapped_type& v = map_[k];
+    Record(HashTableTraceRecord::kInsert, k, ValueSize(v));
+    return v;
+  }
+
+  std::pair<iterator, bool> insert(const value_type& value) {
+    Record(HashTableTraceRecord::kInsert, value.first,
+           ValueSize(value.second));
+    return map_.insert(value);
+  }
+
+  template <typename V>
+  std::pair<iterator, bool> insert_or_assign(const key_type& k, V&& v) {
+    auto result = map_.insert_or_assign(k, std::forward<V>(v));
+    Record(HashTableTraceRecord::kInsert, k, ValueSize(result.first->second));
+    return result;
+  }
+
+  size_t erase(const key_type& k) {
+    Record(HashTableTraceRecord::kErase, k, 0);
+    return map_.erase(k);
+  }
+
+  void clear() {
+    writer_->RecordClear();
+    map_.clear();
+  }
+
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  iterator begin() { return map_.begin(); }
+  iterator end() { return map_.end(); }
+  const_iterator begin() const { return map_.begin(); }
+  const_iterator end() const { return map_.end(); }
+
+  // The underlying map. Operations on it are not traced.
+  Map& map() { return map_; }
+  const Map& map() const { return map_; }
+
+ private:
+  static uint32_t ValueSize(const mapped_type& v) {
+    return HashTableCodec<mapped_type>::Size(v);
+  }
+
+  void Record(HashTableTraceRecord::Op op, const key_type& k,
+              uint32_t value_size) const {
+    const uint64_t hash = writer_->format() == HashTableTraceHeader::kKeyHash
+                              ? map_.hash_function()(k)
+                              : 0;
+    writer_->Record(op, k, hash, value_size);
+  }
+
+  HashTableTraceWriter* const writer_;
+  Map map_;
+};
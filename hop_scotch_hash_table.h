@@ -2,19 +2,60 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <limits>
 #include <memory>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+
+#include "hash_table_instrumentation.h"
 
 // HopScotchHashTable is an implementation detail that underlies InlinedHashMap
 // and InlinedHashSet. It's not for public use.
 //
 // NumInlinedBuckets is the number of elements stored in-line with the table.
+// Once the table grows past them, all the buckets move to one heap array, so
+// that a bucket is addressed the same way in small and large tables.
+//
+// Options is a class that may define the following optional methods. The
+// default is HopScotchHashTableOptions, which defines none.
+//
+//   bool UseOccupancyBitmap() const;
+//   HopScotchHashTableCounters* Counters() const;
+//   void OnResize(const HashTableResizeEvent& event) const;
+//   const char* RegistryTag() const;
+//   uint32_t SampleEvery() const;
+//
+// If UseOccupancyBitmap() returns true, the table keeps one bit per bucket
+// that records whether the bucket has been occupied or has had a leaf since
+// the last clear(). Iteration then skips 64 unused buckets at a time, and
+// clear() and destruction visit only the used buckets, which helps large
+// tables that are sparsely populated, e.g., ones that are cleared and reused.
+// The bitmap is kept only for tables larger than NumInlinedBuckets, in the
+// then unused inlined buckets if it fits there, or else at the end of the
+// bucket allocation. The default is false.
+//
+// If Counters() returns non-null, the table records how inserts go into the
+// returned object: how many elements they displace, and why they expand the
+// table. Several tables may share one object, but not across threads. When
+// Counters() isn't defined, the bookkeeping compiles away.
+//
+// OnResize() is called at the start and at the end of every expansion of the
+// table, as in InlinedHashTable. See hash_table_instrumentation.h.
+//
+// If RegistryTag() is defined, the table registers itself in
+// HashTableRegistry while it's alive, as in InlinedHashTable.
+//
+// If SampleEvery() returns N > 0, one in N find, insert, and erase calls is
+// sampled, as in InlinedHashTable. The probe length of a find or erase is the
+// number of keys compared; that of an insert is the hop distance plus one.
 //
 // Caution: each method must return the same value across multiple invocations.
 // Returning a compile-time constant allows the compiler to optimize the code
@@ -22,6 +63,60 @@
 //
 // TODO: implement bucket reservation.
 
+struct HopScotchHashTableOptions {};
+
+// Insert statistics collected when Options::Counters() is defined.
+struct HopScotchHashTableCounters {
+  // Number of inserts of new keys.
+  int64_t num_inserts = 0;
+  // Number of elements that inserts moved closer to their home bucket to make
+  // room for the new element.
+  int64_t num_displacements = 0;
+  // Max number of elements moved by one insert.
+  int64_t max_displacements_per_insert = 0;
+  // Number of table expansions because no free bucket was found within
+  // MaxAddDistance() of the home bucket, or because the table had no buckets.
+  int64_t num_expansions_no_free_bucket = 0;
+  // Number of table expansions because a free bucket was found, but
+  // displacements couldn't bring it within MaxHopDistance() of the home bucket.
+  int64_t num_expansions_no_closer_bucket = 0;
+  // The min and the sum of the load factors of the table right before each
+  // expansion. A table that expands at a low load factor usually has a poor
+  // hash function. min_expansion_load_factor is 1 if the table has never
+  // expanded.
+  double min_expansion_load_factor = 1;
+  double sum_expansion_load_factors = 0;
+
+  int64_t num_expansions() const {
+    return num_expansions_no_free_bucket + num_expansions_no_closer_bucket;
+  }
+  double mean_expansion_load_factor() const {
+    return num_expansions() == 0
+               ? 0
+               : sum_expansion_load_factors / num_expansions();
+  }
+};
+
+// Snapshot of the state of a HopScotchHashTable, returned by GetStats().
+struct HopScotchHashTableStats {
+  // Size of hop_distance_histogram. Equals the max hop distance of the table.
+  static constexpr int kHopDistanceBuckets = 31;
+
+  size_t size = 0;
+  size_t capacity = 0;
+  // size / capacity.
+  double load_factor = 0;
+  // hop_distance_histogram[i] is the number of elements stored i buckets
+  // after the bucket that their key hashes to.
+  std::array<size_t, kHopDistanceBuckets> hop_distance_histogram{};
+  double mean_hop_distance = 0;
+  int max_hop_distance = 0;
+  // The max, over all buckets, of the fraction of occupied buckets in the
+  // neighborhood that starts at the bucket. Inserts into a neighborhood that
+  // is close to full have to displace elements, and fail when it's full.
+  double max_neighborhood_fill = 0;
+};
+
 class HopScotchHashTableBucketMetadata {
  public:
   HopScotchHashTableBucketMetadata() : mask_(0), occupied_(0) {}
@@ -81,8 +176,32 @@ class HopScotchHashTableBucketMetadata {
   unsigned occupied_ : 1;
 };
 
+// True if a T can be copied by copying its bytes, and dropped without running
+// its destructor.
+template <typename T>
+struct HopScotchHashTableIsBitwiseCopyable
+    : std::integral_constant<bool,
+                             std::is_trivially_copy_constructible<T>::value &&
+                                 std::is_trivially_destructible<T>::value> {};
+
+// Base of HopScotchHashTableManualConstructor<T> that deletes its copy
+// operations unless T is bitwise copyable.
+template <bool kCopyable>
+class HopScotchHashTableManualConstructorBase {};
+
+template <>
+class HopScotchHashTableManualConstructorBase<false> {
+ public:
+  HopScotchHashTableManualConstructorBase() = default;
+  HopScotchHashTableManualConstructorBase(
+      const HopScotchHashTableManualConstructorBase&) = delete;
+  void operator=(const HopScotchHashTableManualConstructorBase&) = delete;
+};
+
 template <typename T>
-class HopScotchHashTableManualConstructor {
+class HopScotchHashTableManualConstructor
+    : private HopScotchHashTableManualConstructorBase<
+          HopScotchHashTableIsBitwiseCopyable<T>::value> {
  public:
   HopScotchHashTableManualConstructor() {}
 
@@ -92,7 +211,7 @@ class HopScotchHashTableManualConstructor {
 
   template <typename... Arg>
   void New(Arg&&... values) {
-    new (buf_) T(std::forward<T>(values)...);
+    new (buf_) T(std::forward<Arg>(values)...);
   }
 
   template <typename... Arg>
@@ -105,86 +224,108 @@ class HopScotchHashTableManualConstructor {
   void Delete() { Mutable()->~T(); }
 
  private:
-  HopScotchHashTableManualConstructor(const HopScotchHashTableManualConstructor&) =
-      delete;
-  void operator=(const HopScotchHashTableManualConstructor&) = delete;
-  uint8_t buf_[sizeof(T)];
+  alignas(T) uint8_t buf_[sizeof(T)];
 };
 
-template <typename Key, typename Value, int NumInlinedBuckets, typename GetKey,
-          typename Hash, typename EqualTo, typename IndexType>
-class HopScotchHashTable {
- public:
-  using BucketMetadata = HopScotchHashTableBucketMetadata;
-  struct Bucket {
-    BucketMetadata md;
-    HopScotchHashTableManualConstructor<Value> value;
-
-    Bucket() {}
-    ~Bucket() {
-      if (md.IsOccupied()) {
-        value.Delete();
-      }
+// A bucket of HopScotchHashTable. The value is constructed only while the
+// bucket is occupied. The bucket is trivially destructible; the table destroys
+// the values of the occupied buckets.
+template <typename Value, bool kBitwiseCopyable =
+                              HopScotchHashTableIsBitwiseCopyable<Value>::value>
+struct HopScotchHashTableBucket {
+  HopScotchHashTableBucketMetadata md;
+  HopScotchHashTableManualConstructor<Value> value;
+
+  HopScotchHashTableBucket() {}
+
+  HopScotchHashTableBucket(const HopScotchHashTableBucket& other) {
+    md = other.md;
+    if (md.IsOccupied()) {
+      value.New(other.value.Get());
     }
+  }
 
-    Bucket(const Bucket& other) {
-      md = other.md;
-      if (md.IsOccupied()) {
-        value.New(other.value.Get());
-      }
+  HopScotchHashTableBucket(HopScotchHashTableBucket&& other) {
+    md = other.md;
+    other.md.ClearAll();
+    if (md.IsOccupied()) {
+      value.New(std::move(*other.value.Mutable()));
     }
+  }
 
-    Bucket(Bucket&& other) {
-      md = other.md;
-      other.md.ClearAll();
-      if (md.IsOccupied()) {
-        value.New(std::move(*other.value.Mutable()));
-      }
+  HopScotchHashTableBucket& operator=(HopScotchHashTableBucket&& other) {
+    if (md.IsOccupied()) {
+      value.Delete();
     }
-
-    Bucket& operator=(Bucket&& other) {
-      if (md.IsOccupied()) {
-        value.Delete();
-      }
-      md = other.md;
-      other.md.ClearAll();
-      if (md.IsOccupied()) {
-        value.New(std::move(*other.value.Mutable()));
-      }
-      return *this;
+    md = other.md;
+    other.md.ClearAll();
+    if (md.IsOccupied()) {
+      value.New(std::move(*other.value.Mutable()));
     }
+    return *this;
+  }
 
-    Bucket& operator=(const Bucket& other) {
-      if (md.IsOccupied()) {
-        value.Delete();
-      }
-      md = other.md;
-      if (md.IsOccupied()) {
-        value.New(other.value.Get());
-      }
-      return *this;
+  HopScotchHashTableBucket& operator=(const HopScotchHashTableBucket& other) {
+    if (md.IsOccupied()) {
+      value.Delete();
     }
-  };
+    md = other.md;
+    if (md.IsOccupied()) {
+      value.New(other.value.Get());
+    }
+    return *this;
+  }
+};
+
+// For bitwise copyable values, the bucket is trivially copyable, so the table
+// copies buckets with memcpy. The bytes of an unoccupied bucket's value are
+// copied as well, which is harmless.
+template <typename Value>
+struct HopScotchHashTableBucket<Value, true> {
+  HopScotchHashTableBucketMetadata md;
+  HopScotchHashTableManualConstructor<Value> value;
+};
+
+template <typename Key, typename Value, int NumInlinedBuckets, typename GetKey,
+          typename Hash, typename EqualTo, typename IndexType,
+          typename Options = HopScotchHashTableOptions>
+class HopScotchHashTable {
+ public:
+  using BucketMetadata = HopScotchHashTableBucketMetadata;
+  using Bucket = HopScotchHashTableBucket<Value>;
   static_assert((NumInlinedBuckets & (NumInlinedBuckets - 1)) == 0,
                 "NumInlinedBuckets must be a power of two");
   HopScotchHashTable(IndexType bucket_count, const Hash& hash,
-                   const EqualTo& equal_to)
+                   const EqualTo& equal_to, const Options& options = Options())
       : hash_(hash),
         equal_to_(equal_to),
-        array_(ComputeCapacity(bucket_count)) {}
+        options_(options),
+        array_(ComputeCapacity(bucket_count), UseOccupancyBitmap()) {
+    HashTableRegister(this, options_);
+  }
 
-  HopScotchHashTable(const HopScotchHashTable& other) : array_(NumInlinedBuckets) {
-    *this = other;
+  HopScotchHashTable(const HopScotchHashTable& other)
+      : get_key_(other.get_key_),
+        hash_(other.hash_),
+        equal_to_(other.equal_to_),
+        options_(other.options_),
+        array_(other.array_) {
+    HashTableRegister(this, options_);
   }
-  HopScotchHashTable(HopScotchHashTable&& other) : array_(NumInlinedBuckets) {
+  HopScotchHashTable(HopScotchHashTable&& other)
+      : array_(NumInlinedBuckets, false) {
     *this = std::move(other);
+    HashTableRegister(this, options_);
   }
 
+  ~HopScotchHashTable() { HashTableUnregister(this, options_); }
+
   HopScotchHashTable& operator=(const HopScotchHashTable& other) {
     array_ = other.array_;
     get_key_ = other.get_key_;
     hash_ = other.hash_;
     equal_to_ = other.equal_to_;
+    options_ = other.options_;
     return *this;
   }
   HopScotchHashTable& operator=(HopScotchHashTable&& other) {
@@ -192,13 +333,14 @@ class HopScotchHashTable {
     get_key_ = std::move(other.get_key_);
     hash_ = std::move(other.hash_);
     equal_to_ = std::move(other.equal_to_);
+    options_ = std::move(other.options_);
     return *this;
   }
 
   class iterator {
    public:
     using Table = HopScotchHashTable<Key, Value, NumInlinedBuckets, GetKey, Hash,
-                                   EqualTo, IndexType>;
+                                   EqualTo, IndexType, Options>;
     iterator(Table* table, IndexType index) : table_(table), index_(index) {}
     iterator(const typename Table::iterator& i)
         : table_(i.table_), index_(i.index_) {}
@@ -236,7 +378,7 @@ class HopScotchHashTable {
   class const_iterator {
    public:
     using Table = HopScotchHashTable<Key, Value, NumInlinedBuckets, GetKey, Hash,
-                                   EqualTo, IndexType>;
+                                   EqualTo, IndexType, Options>;
     const_iterator() {}
     const_iterator(const Table::iterator& i)
         : table_(i.table_), index_(i.index_) {}
@@ -282,7 +424,7 @@ class HopScotchHashTable {
   iterator end() { return iterator(nullptr, kEnd); }
 
   const_iterator cbegin() const {
-    return const_iterator(this, NextValidElement(array_, 0));
+    return const_iterator(this, array_.NextValidElement(0));
   }
   const_iterator cend() const { return const_iterator(nullptr, kEnd); }
   const_iterator begin() const { return cbegin(); }
@@ -290,7 +432,7 @@ class HopScotchHashTable {
 
   iterator find(const Key& k) {
     IndexType index;
-    if (FindInArray(array_, k, hash_(k), &index)) {
+    if (SampledFind(k, &index)) {
       return iterator(this, index);
     } else {
       return end();
@@ -299,7 +441,7 @@ class HopScotchHashTable {
 
   const_iterator find(const Key& k) const {
     IndexType index;
-    if (FindInArray(array_, k, &index)) {
+    if (SampledFind(k, &index)) {
       return const_iterator(this, index);
     } else {
       return cend();
@@ -307,48 +449,46 @@ class HopScotchHashTable {
   }
 
   void clear() {
-    for (Bucket& bucket : array_.inlined_) {
-      if (bucket.md.IsOccupied()) {
-        bucket.value.Delete();
+    array_.ForEachUsedBucket([this](IndexType i) {
+      Bucket* bucket = array_.MutableBucket(i);
+      if (bucket->md.IsOccupied()) {
+        bucket->value.Delete();
       }
-      bucket.md.ClearAll();
-    }
-    if (array_.outlined_ != nullptr) {
-      for (size_t i = 0; i < array_.capacity() - array_.inlined_.size(); ++i) {
-        Bucket* bucket = &array_.outlined_[i];
-        if (bucket->md.IsOccupied()) {
-          bucket->value.Delete();
-        }
-        bucket->md.ClearAll();
-      }
-    }
+      bucket->md.ClearAll();
+    });
+    array_.ClearBitmap();
     array_.size_ = 0;
   }
 
   // Erases the element pointed to by "i". Returns the iterator to the next
   // valid element.
   iterator erase(iterator itr) {
-    Bucket* bucket = array_.MutableBucket(itr.index_);
-    assert(bucket->md.IsOccupied());
     assert(itr.table_ == this);
-    size_t hash = hash_(get_key_.Get(bucket->value.Get()));
-    IndexType origin_index = array_.Clamp(hash);
-    Bucket* origin = array_.MutableBucket(origin_index);
-
-    bucket->md.ClearOccupied();
-    bucket->value.Delete();
-    int delta = array_.Distance(origin_index, itr.index_);
-    origin->md.ClearLeaf(delta);
-    --array_.size_;
+    const Bucket& bucket = array_.GetBucket(itr.index_);
+    assert(bucket.md.IsOccupied());
+    EraseAt(itr.index_, hash_(get_key_.Get(bucket.value.Get())));
     return iterator(this, array_.NextValidElement(itr.index_ + 1));
   }
 
   // If "k" exists in the table, erase it and return 1. Else return 0.
   IndexType erase(const Key& k) {
-    iterator i = find(k);
-    if (i == end()) return 0;
-    erase(i);
-    return 1;
+    IndexType index;
+    if (!HashTableShouldSample(options_)) {
+      const size_t hash = hash_(k);
+      if (!FindInArray(array_, k, hash, &index)) return 0;
+      EraseAt(index, hash);
+      return 1;
+    }
+    int probes;
+    const uint64_t start = HashTableCycles();
+    const size_t hash = hash_(k);
+    const bool found = FindInArray(array_, k, hash, &index, &probes);
+    if (found) EraseAt(index, hash);
+    HashTableRecordSample(
+        HashTableSample::ERASE,
+        found ? HashTableSample::HIT : HashTableSample::MISS, probes,
+        HashTableCycles() - start);
+    return found ? 1 : 0;
   }
 
   std::pair<iterator, bool> insert(Value&& value) {
@@ -374,6 +514,59 @@ class HopScotchHashTable {
   bool empty() const { return array_.size_ == 0; }
   IndexType size() const { return array_.size_; }
   IndexType capacity() const { return array_.capacity(); }
+  const Hash& hash() const { return hash_; }
+  const EqualTo& equal_to() const { return equal_to_; }
+  const Options& options() const { return options_; }
+
+  // Takes O(capacity()) time and doesn't allocate memory.
+  HopScotchHashTableStats GetStats() const {
+    using Stats = HopScotchHashTableStats;
+    static_assert(Stats::kHopDistanceBuckets == MaxHopDistance(),
+                  "kHopDistanceBuckets");
+    Stats stats;
+    stats.size = array_.size_;
+    stats.capacity = array_.capacity();
+    if (array_.capacity() == 0) return stats;
+    stats.load_factor = static_cast<double>(array_.size_) / array_.capacity();
+    int64_t total_hop_distance = 0;
+    array_.ForEachUsedBucket([this, &stats, &total_hop_distance](IndexType i) {
+      if (!array_.GetBucket(i).md.IsOccupied()) return;
+      const int distance = HopDistance(i);
+      ++stats.hop_distance_histogram[distance];
+      total_hop_distance += distance;
+      stats.max_hop_distance = std::max(stats.max_hop_distance, distance);
+    });
+    if (array_.size_ > 0) {
+      stats.mean_hop_distance =
+          static_cast<double>(total_hop_distance) / array_.size_;
+    }
+    // Slide a window of MaxHopDistance() buckets over the array.
+    const IndexType window =
+        std::min<IndexType>(MaxHopDistance(), array_.capacity());
+    IndexType num_occupied = 0;
+    for (IndexType i = 0; i < window; ++i) {
+      num_occupied += array_.GetBucket(i).md.IsOccupied();
+    }
+    IndexType max_occupied = num_occupied;
+    for (IndexType i = 0; i < array_.capacity(); ++i) {
+      const IndexType next = array_.Clamp(i + window);
+      num_occupied -= array_.GetBucket(i).md.IsOccupied();
+      num_occupied += array_.GetBucket(next).md.IsOccupied();
+      max_occupied = std::max(max_occupied, num_occupied);
+    }
+    stats.max_neighborhood_fill = static_cast<double>(max_occupied) / window;
+    return stats;
+  }
+
+  // Backdoor method used by HashTableRegistry. Takes O(1) time.
+  HashTableRegistry::Usage RegistryUsage() const {
+    HashTableRegistry::Usage usage;
+    usage.size = array_.size();
+    usage.capacity = array_.capacity();
+    usage.inlined_bytes = sizeof(*this);
+    usage.outlined_bytes = array_.OutlinedBytes();
+    return usage;
+  }
 
   // Backdoor methods used by map operator[].
   Bucket* MutableBucket(IndexType index) { return array_.MutableBucket(index); }
@@ -381,19 +574,86 @@ class HopScotchHashTable {
     return array_.GetBucket(index);
   }
 
+  // Backdoor methods used by hash_table_serializer.h to rebuild a table
+  // bucket by bucket.
+  //
+  // HopDistance returns the distance of the index'th bucket, which must be
+  // occupied, from the bucket its key hashes to.
+  int HopDistance(IndexType index) const {
+    const Bucket& bucket = array_.GetBucket(index);
+    assert(bucket.md.IsOccupied());
+    const IndexType origin_index =
+        array_.Clamp(hash_(ExtractKey(bucket.value.Get())));
+    return array_.Distance(origin_index, index);
+  }
+  // Discard all the elements and resize the table to exactly "capacity"
+  // buckets. "capacity" must be zero or a power of two, and must be at least
+  // NumInlinedBuckets.
+  void ResetCapacity(IndexType capacity) {
+    array_ = Array(capacity, UseOccupancyBitmap());
+  }
+  // Store "value" in the index'th bucket, whose key hashes to the bucket
+  // "distance" before it. Returns false if the bucket is already occupied or
+  // the distance is out of range.
+  bool RestoreValue(IndexType index, int distance, Value&& value) {
+    if (index >= array_.capacity() || distance < 0 ||
+        distance >= MaxHopDistance()) {
+      return false;
+    }
+    Bucket* bucket = array_.MutableBucket(index);
+    Bucket* origin = array_.MutableBucket(array_.Clamp(index - distance));
+    if (bucket->md.IsOccupied() || origin->md.HasLeaf(distance)) return false;
+    origin->md.SetLeaf(distance);
+    bucket->md.SetOccupied();
+    array_.MarkUsed(array_.Clamp(index - distance));
+    array_.MarkUsed(index);
+    bucket->value.New(std::move(value));
+    ++array_.size_;
+    return true;
+  }
+
   enum InsertResult { KEY_FOUND, EMPTY_SLOT_FOUND, ARRAY_FULL };
   InsertResult Insert(const Key& key, IndexType* index) {
+    if (!HashTableShouldSample(options_)) return Insert(key, hash_(key), index);
+    const IndexType old_capacity = array_.capacity();
+    const uint64_t start = HashTableCycles();
     const size_t hash = hash_(key);
+    const InsertResult result = Insert(key, hash, index);
+    const uint64_t cycles = HashTableCycles() - start;
+    HashTableSample::Result sample_result = HashTableSample::HIT;
+    if (result != KEY_FOUND) {
+      sample_result = array_.capacity() == old_capacity
+                          ? HashTableSample::MISS
+                          : HashTableSample::GROW;
+    }
+    HashTableRecordSample(
+        HashTableSample::INSERT, sample_result,
+        array_.Distance(array_.Clamp(hash), *index) + 1, cycles);
+    return result;
+  }
+
+  InsertResult Insert(const Key& key, size_t hash, IndexType* index) {
     if (FindInArray(array_, key, hash, index)) {
       return KEY_FOUND;
     }
+    HopScotchHashTableCounters* counters = Counters();
     for (int iter = 0; iter < 4; ++iter) {
-      InsertResult result = InsertInArray(&array_, key, hash, index);
+      InsertResult result = InsertInArray(&array_, key, hash, index, counters);
       if (result == KEY_FOUND) return result;
       if (result != ARRAY_FULL) {
         ++array_.size_;
+        if (counters != nullptr) ++counters->num_inserts;
         return result;
       }
+      if (counters != nullptr) {
+        const double load_factor =
+            array_.capacity() == 0
+                ? 0
+                : static_cast<double>(array_.size_) / array_.capacity();
+        counters->min_expansion_load_factor =
+            std::min(counters->min_expansion_load_factor, load_factor);
+        counters->sum_expansion_load_factors += load_factor;
+      }
       ExpandTable(1);
     }
     abort();
@@ -408,36 +668,72 @@ class HopScotchHashTable {
   // Representation of the hash table.
   class Array {
    public:
-    explicit Array(IndexType capacity_arg)
+    // If "use_bitmap", set up the occupancy bitmap when the array has
+    // outlined buckets.
+    Array(IndexType capacity_arg, bool use_bitmap)
         : size_(0), capacity_mask_(capacity_arg - 1) {
       assert((capacity() & capacity_mask()) == 0);
       if (capacity() > inlined_.size()) {
-        outlined_.reset(new Bucket[capacity() - inlined_.size()]);
+        Allocate(use_bitmap);
+        ClearBitmap();
       }
     }
 
-    Array(const Array& other) { *this = other; }
+    Array(const Array& other) : size_(0), capacity_mask_(NumInlinedBuckets - 1) {
+      *this = other;
+    }
+
+    Array(Array&& other) : size_(0), capacity_mask_(NumInlinedBuckets - 1) {
+      *this = std::move(other);
+    }
 
-    Array(Array&& other) { *this = std::move(other); }
+    ~Array() { DestroyValues(); }
 
     Array& operator=(const Array& other) {
+      if (this == &other) return *this;
+      DestroyValues();
+      ReleaseBitmap();
       size_ = other.size_;
       capacity_mask_ = other.capacity_mask_;
-      inlined_ = other.inlined_;
-      if (other.outlined_ != nullptr) {
-        const size_t n = other.capacity() - inlined_.size();
-        outlined_.reset(new Bucket[n]);
-        std::copy(&other.outlined_[0], &other.outlined_[n], &outlined_[0]);
+      if (other.outlined_ == nullptr) {
+        outlined_.reset();
+        CopyBuckets(other.inlined_.data(), NumInlinedBuckets, inlined_.data(),
+                    std::is_trivially_copyable<Bucket>());
+        return *this;
+      }
+      Allocate(other.bitmap_ != nullptr);
+      CopyBuckets(other.outlined_.get(), other.capacity(), outlined_.get(),
+                  std::is_trivially_copyable<Bucket>());
+      if (bitmap_ != nullptr) {
+        memcpy(bitmap_, other.bitmap_, NumBitmapWords() * sizeof(uint64_t));
       }
       return *this;
     }
 
     Array& operator=(Array&& other) {
+      if (this == &other) return *this;
+      DestroyValues();
+      ReleaseBitmap();
       size_ = other.size_;
       capacity_mask_ = other.capacity_mask_;
-      inlined_ = std::move(other.inlined_);
-      outlined_ = std::move(other.outlined_);
+      if (other.outlined_ == nullptr) {
+        outlined_.reset();
+        MoveBuckets(other.inlined_.data(), NumInlinedBuckets, inlined_.data(),
+                    std::is_trivially_copyable<Bucket>());
+      } else {
+        outlined_ = std::move(other.outlined_);
+        if (other.bitmap_ != nullptr &&
+            other.bitmap_ == other.InlinedBitmap()) {
+          // The bitmap can't move with outlined_. Copy it.
+          bitmap_ = InlinedBitmap();
+          memcpy(bitmap_, other.bitmap_, NumBitmapWords() * sizeof(uint64_t));
+        } else {
+          bitmap_ = other.bitmap_;
+          other.bitmap_ = nullptr;
+        }
+      }
 
+      other.ReleaseBitmap();
       other.outlined_.reset();
       other.size_ = 0;
       other.capacity_mask_ = other.inlined_.size() - 1;
@@ -450,21 +746,20 @@ class HopScotchHashTable {
       return *this;
     }
 
-    // Return the index'th slot in array.
-    const Bucket& GetBucket(IndexType index) const {
-      if (index < NumInlinedBuckets) {
-        return inlined_[index];
-      }
-      return outlined_[index - NumInlinedBuckets];
+    // Returns the array of capacity() buckets: inlined_ if they fit there,
+    // else outlined_.
+    const Bucket* buckets() const {
+      return outlined_ != nullptr ? outlined_.get() : inlined_.data();
+    }
+    Bucket* buckets() {
+      return outlined_ != nullptr ? outlined_.get() : inlined_.data();
     }
 
+    // Return the index'th slot in array.
+    const Bucket& GetBucket(IndexType index) const { return buckets()[index]; }
+
     // Return the mutable pointer to the index'th slot in array.
-    Bucket* MutableBucket(IndexType index) {
-      if (index < NumInlinedBuckets) {
-        return &inlined_[index];
-      }
-      return &outlined_[index - NumInlinedBuckets];
-    }
+    Bucket* MutableBucket(IndexType index) { return &buckets()[index]; }
 
     IndexType Clamp(IndexType index) const { return index & capacity_mask_; }
 
@@ -476,6 +771,20 @@ class HopScotchHashTable {
     // Find the first filled slot at or after "from". For incremenenting an
     // iterator.
     IndexType NextValidElement(IndexType from) const {
+      if (bitmap_ != nullptr) {
+        for (IndexType i = from; i < capacity(); ++i) {
+          const uint64_t word = bitmap_[i / 64] & (~uint64_t(0) << (i % 64));
+          if (word == 0) {
+            i = (i / 64) * 64 + 63;
+            continue;
+          }
+          i = (i / 64) * 64 + __builtin_ctzll(word);
+          if (GetBucket(i).md.IsOccupied()) {
+            return i;
+          }
+        }
+        return kEnd;
+      }
       IndexType i = from;
       for (;;) {
         if (i >= capacity()) {
@@ -493,29 +802,162 @@ class HopScotchHashTable {
     IndexType capacity() const { return capacity_mask_ + 1; }
     IndexType size() const { return size_; }
 
-    // First NumInlinedBuckets are stored in inlined. The rest are stored in
-    // outlined.
+    IndexType NumBitmapWords() const { return (capacity() + 63) / 64; }
+
+    // Bytes allocated for the outlined buckets and the bitmap.
+    size_t OutlinedBytes() const {
+      if (outlined_ == nullptr) return 0;
+      return NumOutlinedBuckets(bitmap_ != nullptr) * sizeof(Bucket);
+    }
+
+    // Record that the index'th bucket has been occupied or has had a leaf.
+    void MarkUsed(IndexType index) {
+      if (bitmap_ != nullptr) {
+        bitmap_[index / 64] |= uint64_t(1) << (index % 64);
+      }
+    }
+
+    void ClearBitmap() {
+      if (bitmap_ != nullptr) {
+        memset(bitmap_, 0, NumBitmapWords() * sizeof(uint64_t));
+      }
+    }
+
+    // The bitmap of an outlined array is stored in inlined_, which is
+    // otherwise unused, if it fits there. Else it follows the buckets in
+    // outlined_. Either way, it needs no allocation of its own.
+    bool BitmapIsInlined() const {
+      return alignof(Bucket) >= alignof(uint64_t) &&
+             NumBitmapWords() * sizeof(uint64_t) <=
+                 NumInlinedBuckets * sizeof(Bucket);
+    }
+
+    // Byte offset of the bitmap from the start of outlined_, when it's not
+    // inlined.
+    size_t BitmapOffset() const {
+      const size_t bytes = capacity() * sizeof(Bucket);
+      return (bytes + alignof(uint64_t) - 1) & ~(alignof(uint64_t) - 1);
+    }
+
+    // Number of Buckets to allocate for outlined_: capacity(), plus room
+    // for the bitmap if "use_bitmap" and it doesn't fit in inlined_.
+    size_t NumOutlinedBuckets(bool use_bitmap) const {
+      if (!use_bitmap || BitmapIsInlined()) return capacity();
+      const size_t bytes =
+          BitmapOffset() + NumBitmapWords() * sizeof(uint64_t);
+      return (bytes + sizeof(Bucket) - 1) / sizeof(Bucket);
+    }
+
+    uint64_t* InlinedBitmap() {
+      return reinterpret_cast<uint64_t*>(inlined_.data());
+    }
+
+    // Allocate outlined_ for capacity() buckets, and point bitmap_ to
+    // uninitialized bitmap words if "use_bitmap". inlined_ must hold no
+    // values.
+    void Allocate(bool use_bitmap) {
+      outlined_.reset(new Bucket[NumOutlinedBuckets(use_bitmap)]);
+      if (!use_bitmap) {
+        bitmap_ = nullptr;
+      } else if (BitmapIsInlined()) {
+        bitmap_ = InlinedBitmap();
+      } else {
+        bitmap_ = reinterpret_cast<uint64_t*>(
+            reinterpret_cast<char*>(outlined_.get()) + BitmapOffset());
+      }
+    }
+
+    // Drop the bitmap. If it was stored in inlined_, turn inlined_ back
+    // into empty buckets. Call after DestroyValues().
+    void ReleaseBitmap() {
+      if (bitmap_ != nullptr && bitmap_ == InlinedBitmap()) {
+        for (Bucket& bucket : inlined_) new (&bucket) Bucket();
+      }
+      bitmap_ = nullptr;
+    }
+
+    // Call fn(index) for every bucket that may be occupied or have leaves.
+    // Without a bitmap, that's every bucket in the array.
+    template <typename Fn>
+    void ForEachUsedBucket(Fn fn) const {
+      if (bitmap_ != nullptr) {
+        const IndexType num_words = NumBitmapWords();
+        for (IndexType w = 0; w < num_words; ++w) {
+          for (uint64_t word = bitmap_[w]; word != 0; word &= word - 1) {
+            fn(w * 64 + __builtin_ctzll(word));
+          }
+        }
+        return;
+      }
+      for (IndexType i = 0; i < capacity(); ++i) fn(i);
+    }
+
+    // Destroy the values of the occupied buckets, and mark them unoccupied.
+    void DestroyValues() {
+      if (std::is_trivially_destructible<Value>::value) return;
+      ForEachUsedBucket([this](IndexType i) {
+        Bucket* bucket = MutableBucket(i);
+        if (bucket->md.IsOccupied()) {
+          bucket->value.Delete();
+          bucket->md.ClearOccupied();
+        }
+      });
+    }
+
+    // Assign the "n" buckets at "src" to the ones at "dest". Trivially
+    // copyable buckets are copied with one memcpy, in a single sequential
+    // pass.
+    static void CopyBuckets(const Bucket* src, size_t n, Bucket* dest,
+                            std::true_type) {
+      static_assert(std::is_trivially_copyable<Bucket>::value,
+                    "Bucket must be trivially copyable");
+      if (n > 0) memcpy(dest, src, n * sizeof(Bucket));
+    }
+    static void CopyBuckets(const Bucket* src, size_t n, Bucket* dest,
+                            std::false_type) {
+      std::copy(src, src + n, dest);
+    }
+    // Like CopyBuckets(), but moves the values out of "src".
+    static void MoveBuckets(Bucket* src, size_t n, Bucket* dest,
+                            std::true_type) {
+      CopyBuckets(src, n, dest, std::true_type());
+    }
+    static void MoveBuckets(Bucket* src, size_t n, Bucket* dest,
+                            std::false_type) {
+      std::move(src, src + n, dest);
+    }
+
+    // The buckets are stored in inlined_ if capacity() <= NumInlinedBuckets,
+    // and in outlined_ otherwise. In the latter case, inlined_ holds only
+    // the bitmap, if any.
     std::array<Bucket, NumInlinedBuckets> inlined_;
     std::unique_ptr<Bucket[]> outlined_;
+    // Occupancy bitmap, in inlined_ or at the end of outlined_. See the
+    // comment on UseOccupancyBitmap at the top of the file. Null if unused.
+    uint64_t* bitmap_ = nullptr;
     // # of filled slots.
     IndexType size_;
-    // Capacity of inlined + capacity of outlined. Always a power of two.
+    // Capacity-1. The capacity is zero or a power of two.
     IndexType capacity_mask_;
   };
 
   // Find "k" in the array. If found, set *index to the location of the key in
-  // the array.
+  // the array. If "probes" is non-null, set *probes to the number of buckets
+  // whose keys are compared.
   bool FindInArray(const Array& array, const Key& k, size_t hash,
-                   IndexType* index) const {
+                   IndexType* index, int* probes = nullptr) const {
+    if (probes != nullptr) *probes = 0;
     if (__builtin_expect(array.capacity() == 0, 0)) return false;
 
+    const Bucket* buckets = array.buckets();
     const IndexType start_index = array.Clamp(hash);
-    const BucketMetadata& md = array.GetBucket(start_index).md;
+    const BucketMetadata& md = buckets[start_index].md;
     BucketMetadata::LeafIterator it(&md);
     int distance;
     while ((distance = it.Next()) >= 0) {
+      if (probes != nullptr) ++*probes;
       *index = array.Clamp(start_index + distance);
-      const Bucket& elem = array.GetBucket(*index);
+      const Bucket& elem = buckets[*index];
       if (equal_to_(k, ExtractKey(elem.value.Get()))) {
         return true;
       }
@@ -534,35 +976,57 @@ class HopScotchHashTable {
   static constexpr int MaxAddDistance() { return 256; }
 
   // Either find "k" in the array, or find a slot into which "k" can be
-  // inserted.
+  // inserted. If "counters" is non-null, record the displacements and the
+  // reason for returning ARRAY_FULL.
   InsertResult InsertInArray(Array* array, const Key& k, size_t hash,
-                             IndexType* index_found) {
-    if (__builtin_expect(array->capacity() == 0, 0)) return ARRAY_FULL;
+                             IndexType* index_found,
+                             HopScotchHashTableCounters* counters = nullptr) {
+    if (__builtin_expect(array->capacity() == 0, 0)) {
+      if (counters != nullptr) ++counters->num_expansions_no_free_bucket;
+      return ARRAY_FULL;
+    }
+    Bucket* buckets = array->buckets();
     const IndexType origin_index = array->Clamp(hash);
-    Bucket* origin_bucket = array->MutableBucket(origin_index);
+    Bucket* origin_bucket = &buckets[origin_index];
     IndexType free_index = kEnd;
     for (int i = 0;
          i < std::min<IndexType>(MaxAddDistance(), array->capacity()); ++i) {
       const IndexType index = array->Clamp(origin_index + i);
-      const Bucket& elem = array->GetBucket(index);
+      const Bucket& elem = buckets[index];
       if (!elem.md.IsOccupied()) {
         free_index = index;
         break;
       }
     }
-    if (free_index == kEnd) return ARRAY_FULL;
+    if (free_index == kEnd) {
+      if (counters != nullptr) ++counters->num_expansions_no_free_bucket;
+      return ARRAY_FULL;
+    }
 
+    int64_t num_displacements = 0;
     do {
       int free_distance = array->Distance(origin_index, free_index);
       if (free_distance < MaxHopDistance()) {
         Bucket* free_bucket = array->MutableBucket(free_index);
         origin_bucket->md.SetLeaf(free_distance);
         free_bucket->md.SetOccupied();
+        array->MarkUsed(origin_index);
+        array->MarkUsed(free_index);
         *index_found = free_index;
+        if (counters != nullptr) {
+          counters->num_displacements += num_displacements;
+          counters->max_displacements_per_insert = std::max(
+              counters->max_displacements_per_insert, num_displacements);
+        }
         return EMPTY_SLOT_FOUND;
       }
       free_index = FindCloserFreeBucket(array, free_index);
+      ++num_displacements;
     } while (free_index != kEnd);
+    if (counters != nullptr) {
+      counters->num_displacements += num_displacements - 1;
+      ++counters->num_expansions_no_closer_bucket;
+    }
     return ARRAY_FULL;
   }
 
@@ -596,8 +1060,10 @@ class HopScotchHashTable {
       moved_bucket->md.SetLeaf(dist);
       moved_bucket->md.ClearLeaf(new_free_dist);
       free_bucket->value.New(std::move(*new_free_bucket->value.Mutable()));
+      new_free_bucket->value.Delete();
       free_bucket->md.SetOccupied();
       new_free_bucket->md.ClearOccupied();
+      array->MarkUsed(free_index);
       return new_free_bucket_index;
     }
     return kEnd;
@@ -607,10 +1073,43 @@ class HopScotchHashTable {
   // current table. It's used to compute the capacity of the new table.
   void ExpandTable(IndexType delta) {
     const IndexType new_capacity = ComputeCapacity(array_.capacity() + delta);
-    Array new_array(new_capacity);
-    for (IndexType i = 0; i < array_.capacity(); ++i) {
+    HashTableResize(options_, array_.capacity(), new_capacity, array_.size_,
+                    [this, new_capacity]() { Rehash(new_capacity); });
+  }
+
+  // Erase the element in the index'th bucket, whose key hashes to "hash".
+  void EraseAt(IndexType index, size_t hash) {
+    Bucket* bucket = array_.MutableBucket(index);
+    const IndexType origin_index = array_.Clamp(hash);
+    Bucket* origin = array_.MutableBucket(origin_index);
+
+    bucket->md.ClearOccupied();
+    bucket->value.Delete();
+    origin->md.ClearLeaf(array_.Distance(origin_index, index));
+    --array_.size_;
+  }
+
+  // Find() that records one in Options::SampleEvery() calls.
+  bool SampledFind(const Key& k, IndexType* index) const {
+    if (!HashTableShouldSample(options_)) {
+      return FindInArray(array_, k, hash_(k), index);
+    }
+    int probes;
+    const uint64_t start = HashTableCycles();
+    const bool found = FindInArray(array_, k, hash_(k), index, &probes);
+    HashTableRecordSample(
+        HashTableSample::FIND,
+        found ? HashTableSample::HIT : HashTableSample::MISS, probes,
+        HashTableCycles() - start);
+    return found;
+  }
+
+  // Move all the elements to a new array with "new_capacity" buckets.
+  void Rehash(IndexType new_capacity) {
+    Array new_array(new_capacity, UseOccupancyBitmap());
+    array_.ForEachUsedBucket([this, &new_array](IndexType i) {
       Bucket* old_bucket = array_.MutableBucket(i);
-      if (!old_bucket->md.IsOccupied()) continue;
+      if (!old_bucket->md.IsOccupied()) return;
       const Key& key = ExtractKey(old_bucket->value.Get());
 
       IndexType new_i;
@@ -618,7 +1117,7 @@ class HopScotchHashTable {
       assert(result == EMPTY_SLOT_FOUND);
       new_array.MutableBucket(new_i)->value.New(
           std::move(*old_bucket->value.Mutable()));
-    }
+    });
     new_array.size_ = array_.size_;
     array_ = std::move(new_array);
   }
@@ -635,32 +1134,64 @@ class HopScotchHashTable {
   Key* ExtractMutableKey(Value* elem) const { return get_key_.Mutable(elem); }
   IndexType ComputeHash(const Key& key) const { return hash_(key); }
 
+  // A template hack to call Options::UseOccupancyBitmap only when it's
+  // defined.
+  template <typename TOptions>
+  static auto SfinaeUseOccupancyBitmap(const TOptions* options)
+      -> decltype(options->UseOccupancyBitmap()) {
+    return options->UseOccupancyBitmap();
+  }
+  static auto SfinaeUseOccupancyBitmap(...) -> bool { return false; }
+  bool UseOccupancyBitmap() const {
+    return SfinaeUseOccupancyBitmap(&options_);
+  }
+
+  // A template hack to call Options::Counters only when it's defined.
+  template <typename TOptions>
+  static auto SfinaeCounters(const TOptions* options)
+      -> decltype(options->Counters()) {
+    return options->Counters();
+  }
+  static auto SfinaeCounters(...) -> HopScotchHashTableCounters* {
+    return nullptr;
+  }
+  HopScotchHashTableCounters* Counters() const {
+    return SfinaeCounters(&options_);
+  }
+
   GetKey get_key_;
   Hash hash_;
   EqualTo equal_to_;
+  Options options_;
   Array array_;
 };
 
 template <typename Key, typename Value, int NumInlinedBuckets,
           typename Hash = std::hash<Key>, typename EqualTo = std::equal_to<Key>,
-          typename IndexType = size_t>
+          typename IndexType = size_t,
+          typename Options = HopScotchHashTableOptions>
 class HopScotchHashMap {
  public:
   using BucketValue = std::pair<Key, Value>;
   using value_type = BucketValue;
+  using key_type = Key;
+  using mapped_type = Value;
+  using hasher = Hash;
+  using key_equal = EqualTo;
   struct GetKey {
     const Key& Get(const BucketValue& elem) const { return elem.first; }
     Key* Mutable(BucketValue* elem) const { return &elem->first; }
   };
   using Table = HopScotchHashTable<Key, BucketValue, NumInlinedBuckets, GetKey,
-                                 Hash, EqualTo, IndexType>;
+                                 Hash, EqualTo, IndexType, Options>;
   using iterator = typename Table::iterator;
   using const_iterator = typename Table::const_iterator;
 
   HopScotchHashMap() : impl_(0, Hash(), EqualTo()) {}
   HopScotchHashMap(IndexType bucket_count, const Hash& hash = Hash(),
-                 const EqualTo& equal_to = EqualTo())
-      : impl_(bucket_count, hash, equal_to) {}
+                 const EqualTo& equal_to = EqualTo(),
+                 const Options& options = Options())
+      : impl_(bucket_count, hash, equal_to, options) {}
 
   bool empty() const { return impl_.empty(); }
   iterator begin() { return impl_.begin(); }
@@ -670,40 +1201,94 @@ class HopScotchHashMap {
   const_iterator begin() const { return impl_.cbegin(); }
   const_iterator end() const { return impl_.cend(); }
   IndexType size() const { return impl_.size(); }
+  Hash hash_function() const { return impl_.hash(); }
+  EqualTo key_eq() const { return impl_.equal_to(); }
   iterator find(const Key& k) { return impl_.find(k); }
   const_iterator find(const Key& k) const { return impl_.find(k); }
 
   std::pair<iterator, bool> insert(value_type&& value) {
     return impl_.insert(std::move(value));
   }
-  iterator erase(iterator i) { return impl_.erase(i); }
-  IndexType erase(const Key& k) { return impl_.erase(k); }
-  void clear() { impl_.clear(); }
-  Value& operator[](const Key& k) {
+  std::pair<iterator, bool> insert(const value_type& value) {
+    return impl_.insert(value);
+  }
+
+  // If "k" doesn't exist in the map, insert an element whose value is
+  // constructed in place from "args". Else, do nothing. In particular, "k" and
+  // "args" are not moved from if "k" already exists.
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const Key& k, Args&&... args) {
+    return TryEmplace(k, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(Key&& k, Args&&... args) {
+    return TryEmplace(std::move(k), std::forward<Args>(args)...);
+  }
+
+  // Same as try_emplace(k, v). Unlike std::unordered_map::emplace, it takes
+  // exactly a key and a value, and constructs nothing if "k" already exists.
+  template <typename K, typename V>
+  std::pair<iterator, bool> emplace(K&& k, V&& v) {
+    return TryEmplace(std::forward<K>(k), std::forward<V>(v));
+  }
+
+  // If "k" exists in the map, assign "v" to its value. Else, insert a new
+  // element constructed in place from "k" and "v".
+  template <typename K, typename V>
+  std::pair<iterator, bool> insert_or_assign(K&& k, V&& v) {
     IndexType index;
     typename Table::InsertResult result = impl_.Insert(k, &index);
     typename Table::Bucket* bucket = impl_.MutableBucket(index);
-    if (result != Table::KEY_FOUND) {
-      bucket->value.New();
-      // newly inserted. fill the key.
-      bucket->value.Mutable()->first = k;
+    if (result == Table::KEY_FOUND) {
+      bucket->value.Mutable()->second = std::forward<V>(v);
+      return std::make_pair(iterator(&impl_, index), false);
     }
-    return bucket->value.Mutable()->second;
+    bucket->value.New(std::forward<K>(k), std::forward<V>(v));
+    return std::make_pair(iterator(&impl_, index), true);
   }
 
+  iterator erase(iterator i) { return impl_.erase(i); }
+  IndexType erase(const Key& k) { return impl_.erase(k); }
+  void clear() { impl_.clear(); }
+  Value& operator[](const Key& k) { return TryEmplace(k).first->second; }
+
   // Non-standard methods, mainly for testing.
   size_t capacity() const { return impl_.capacity(); }
 
+  // Returns the size and the distribution of the hop distances. Cheap enough
+  // to call periodically, e.g., from a metrics exporter: it takes one pass
+  // over the buckets and doesn't allocate.
+  HopScotchHashTableStats GetStats() const { return impl_.GetStats(); }
+
   // For unittests only
   void CheckConsistency() { impl_.CheckConsistency(); }
 
+  // Backdoors for hash_table_serializer.h.
+  const Table& table() const { return impl_; }
+  Table* mutable_table() { return &impl_; }
+
  private:
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> TryEmplace(K&& k, Args&&... args) {
+    IndexType index;
+    typename Table::InsertResult result = impl_.Insert(k, &index);
+    if (result == Table::KEY_FOUND) {
+      return std::make_pair(iterator(&impl_, index), false);
+    }
+    impl_.MutableBucket(index)->value.New(
+        std::piecewise_construct, std::forward_as_tuple(std::forward<K>(k)),
+        std::forward_as_tuple(std::forward<Args>(args)...));
+    return std::make_pair(iterator(&impl_, index), true);
+  }
+
   Table impl_;
 };
 
 template <typename Value, int NumInlinedBuckets,
           typename Hash = std::hash<Value>,
-          typename EqualTo = std::equal_to<Value>, typename IndexType = size_t>
+          typename EqualTo = std::equal_to<Value>, typename IndexType = size_t,
+          typename Options = HopScotchHashTableOptions>
 class HopScotchHashSet {
  public:
   struct Bucket {
@@ -716,14 +1301,15 @@ class HopScotchHashSet {
     Value* Mutable(Value* elem) const { return elem; }
   };
   using Table = HopScotchHashTable<Value, Value, NumInlinedBuckets, GetKey, Hash,
-                                 EqualTo, IndexType>;
+                                 EqualTo, IndexType, Options>;
   using iterator = typename Table::iterator;
   using const_iterator = typename Table::const_iterator;
 
   HopScotchHashSet() : impl_(0, Hash(), EqualTo()) {}
   HopScotchHashSet(IndexType bucket_count, const Hash& hash = Hash(),
-                 const EqualTo& equal_to = EqualTo())
-      : impl_(bucket_count, hash, equal_to) {}
+                 const EqualTo& equal_to = EqualTo(),
+                 const Options& options = Options())
+      : impl_(bucket_count, hash, equal_to, options) {}
   bool empty() const { return impl_.empty(); }
   iterator begin() { return impl_.begin(); }
   iterator end() { return impl_.end(); }
@@ -732,6 +1318,8 @@ class HopScotchHashSet {
   const_iterator begin() const { return impl_.cbegin(); }
   const_iterator end() const { return impl_.cend(); }
   IndexType size() const { return impl_.size(); }
+  Hash hash_function() const { return impl_.hash(); }
+  EqualTo key_eq() const { return impl_.equal_to(); }
   std::pair<iterator, bool> insert(Value&& value) {
     return impl_.insert(std::move(value));
   }
@@ -748,6 +1336,11 @@ class HopScotchHashSet {
   // Non-standard methods, mainly for testing.
   size_t capacity() const { return impl_.capacity(); }
 
+  // Returns the size and the distribution of the hop distances. Cheap enough
+  // to call periodically, e.g., from a metrics exporter: it takes one pass
+  // over the buckets and doesn't allocate.
+  HopScotchHashTableStats GetStats() const { return impl_.GetStats(); }
+
   // For unittests only
   void CheckConsistency() { impl_.CheckConsistency(); }
 
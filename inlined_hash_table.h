@@ -2,25 +2,65 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <limits>
 #include <memory>
+#include <new>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+
+#include "hash_table_instrumentation.h"
+
+// Snapshot of the state of an InlinedHashTable, returned by GetStats().
+struct InlinedHashTableStats {
+  // Size of probe_length_histogram.
+  static constexpr int kProbeLengthBuckets = 32;
+
+  size_t size = 0;
+  size_t capacity = 0;
+  // Number of slots that hold tombstones.
+  size_t num_tombstones = 0;
+  // size / capacity.
+  double load_factor = 0;
+  // probe_length_histogram[i] is the number of elements that a lookup reaches
+  // after visiting i+1 slots. The last bucket also counts longer probes.
+  std::array<size_t, kProbeLengthBuckets> probe_length_histogram{};
+  // GetStats() stops walking a probe sequence after kProbeLengthBuckets
+  // slots, so a longer probe counts as kProbeLengthBuckets in the fields
+  // below: max_probe_length == kProbeLengthBuckets means "at least that
+  // long", and mean_probe_length is then a lower bound.
+  double mean_probe_length = 0;
+  int max_probe_length = 0;
+  // 99th percentile of the probe lengths, computed from the histogram.
+  int p99_probe_length = 0;
+};
 
 // InlinedHashTable is an implementation detail that underlies InlinedHashMap
 // and InlinedHashSet. Not for public use.
 //
 // NumInlinedElements is the number of elements stored in-line with the table.
+// Once the table grows past them, all the elements move to one heap array, so
+// that a slot is addressed the same way in small and large tables, and the
+// in-line space holds the bitmaps described below if they fit.
 //
-// Options is a class that defines one required method, and two optional
+// Options is a class that defines one required method, and seven optional
 // methods.
 //
-//   const Key& EmptyKey() const;    // required
-//   const Key& DeletedKey() const;  // optional
-//   double MaxLoadFactor() const;   // optional
+//   const Key& EmptyKey() const;        // required
+//   const Key& DeletedKey() const;      // optional
+//   double MaxLoadFactor() const;       // optional
+//   bool UseOccupancyBitmap() const;    // optional
+//   bool UseOverflowBits() const;       // optional
+//   void OnResize(const HashTableResizeEvent& event) const;  // optional
+//   const char* RegistryTag() const;    // optional
+//   uint32_t SampleEvery() const;       // optional
 //
 // EmptyKey() should return a key that represents an unused key.  DeletedKey()
 // should return a tombstone key. DeletedKey() needs to be defined iff you use
@@ -35,6 +75,34 @@
 // of the capacity, the hash table is doubled. The valid range of
 // MaxLoadFactor() is (0,1].
 //
+// If UseOccupancyBitmap() returns true, the table keeps one bit per slot that
+// records whether the slot has been filled since the last Clear(). Iteration
+// then skips 64 unused slots at a time, and Clear() visits only the used
+// slots, which helps large tables that are sparsely populated, e.g., ones that
+// are cleared and reused. The bitmap is stored in the in-line space or after
+// the outlined slots, so tables that fit in NumInlinedElements don't pay for
+// it. The default is false.
+//
+// If UseOverflowBits() returns true, the table keeps one bit per slot that is
+// set when an insertion probes past the slot. A lookup that reaches a
+// non-matching slot whose bit is clear stops there, so a miss doesn't need to
+// walk the rest of the cluster to an empty slot. This pays off with a high
+// MaxLoadFactor() and with keys that are expensive to compare. The bits are
+// reset only by Clear() and rehashing, so they help most in tables that see
+// few erasures. The bits are stored like the occupancy bitmap. The default is
+// false.
+//
+// OnResize() is called at the start and at the end of every expansion of the
+// table, with the old and new capacities, the number of elements, and at the
+// end, the time the expansion took. See hash_table_instrumentation.h.
+//
+// If RegistryTag() is defined, the table registers itself in
+// HashTableRegistry while it's alive. See hash_table_instrumentation.h.
+//
+// If SampleEvery() returns N > 0, one in N find, insert, and erase calls made
+// by a thread is timed and recorded in HashTableSampler. See
+// hash_table_instrumentation.h.
+//
 // Parameters Hash and EqualTo are the functors used by
 // std::unordered_{map,set}.
 //
@@ -49,71 +117,96 @@ class InlinedHashTable {
                 "NumInlinedElements must be a power of two");
   InlinedHashTable(IndexType bucket_count, const Options& options,
                    const Hash& hash, const EqualTo& equal_to)
-      : size_(0), options_(options), hash_(hash), equal_to_(equal_to) {
-    const IndexType capacity = ComputeCapacity(bucket_count);
-    capacity_mask_ = capacity - 1;
-    assert((capacity & capacity_mask_) == 0);
-    num_free_slots_and_inlined_.t0() = capacity * MaxLoadFactor();
-    for (Elem& elem : inlined()) {
-      *GetKey::Mutable(&elem) = options_.EmptyKey();
-    }
-    if (Capacity() > inlined().size()) {
-      const IndexType n = Capacity() - inlined().size();
-      outlined_.reset(new Elem[n]);
-      for (IndexType i = 0; i < n; ++i) {
-        *GetKey::Mutable(&outlined_[i]) = options_.EmptyKey();
-      }
-    }
+      : InlinedHashTable(UnregisteredTag(), bucket_count, options, hash,
+                         equal_to) {
+    registered_ = true;
+    HashTableRegister(this, options_);
   }
 
-  InlinedHashTable(const InlinedHashTable& other) { *this = other; }
-  InlinedHashTable(InlinedHashTable&& other) { *this = std::move(other); }
+  InlinedHashTable(const InlinedHashTable& other)
+      : size_(0),
+        capacity_mask_(kNoSlots),
+        options_(other.options_),
+        hash_(other.hash_),
+        equal_to_(other.equal_to_),
+        registered_(true) {
+    CopySlotsFrom(other);
+    HashTableRegister(this, options_);
+  }
+
+  InlinedHashTable(InlinedHashTable&& other)
+      : size_(0),
+        capacity_mask_(kNoSlots),
+        options_(other.options_),
+        hash_(other.hash_),
+        equal_to_(other.equal_to_),
+        registered_(true) {
+    StealSlotsFrom(std::move(other));
+    HashTableRegister(this, options_);
+  }
+
+  ~InlinedHashTable() {
+    if (registered_) HashTableUnregister(this, options_);
+    DestroySlots();
+  }
 
   InlinedHashTable& operator=(const InlinedHashTable& other) {
-    size_ = other.size_;
-    capacity_mask_ = other.capacity_mask_;
+    if (this == &other) return *this;
+    DestroySlots();
     options_ = other.options_;
     hash_ = other.hash_;
-    num_free_slots_and_inlined_ = other.num_free_slots_and_inlined_;
-    if (other.outlined_ != nullptr) {
-      const size_t n = other.Capacity() - inlined().size();
-      outlined_.reset(new Elem[n]);
-      std::copy(&other.outlined_[0], &other.outlined_[n], &outlined_[0]);
-    }
+    equal_to_ = other.equal_to_;
+    CopySlotsFrom(other);
     return *this;
   }
 
   InlinedHashTable& operator=(InlinedHashTable&& other) {
-    size_ = other.size_;
-    capacity_mask_ = other.capacity_mask_;
-    options_ = std::move(other.options_);
-    hash_ = std::move(other.hash_);
-    num_free_slots_and_inlined_ = std::move(other.num_free_slots_and_inlined_);
-    outlined_ = std::move(other.outlined_);
-
-    other.outlined_.reset();
-    other.size_ = 0;
-    other.capacity_mask_ = other.inlined().size() - 1;
-    other.num_free_slots() = other.Capacity() * MaxLoadFactor();
+    if (this == &other) return *this;
+    DestroySlots();
+    options_ = other.options_;
+    hash_ = other.hash_;
+    equal_to_ = other.equal_to_;
+    StealSlotsFrom(std::move(other));
     return *this;
   }
 
-  // Move the contents of "other" over to this table.  "other" will be in an
-  // unspecified state after the call, and the only safe operation is to destroy
-  // it.
+  // Rehash the table into a new array that can hold "desired_size" elements.
+  void Expand(IndexType desired_size) {
+    const IndexType bucket_count = ComputeCapacity(desired_size);
+    // The constructor computes the capacity for "bucket_count" elements.
+    const IndexType new_capacity = ComputeCapacity(bucket_count);
+    HashTableResize(options_, Capacity(), new_capacity, size_,
+                    [this, bucket_count]() {
+                      InlinedHashTable new_table(UnregisteredTag(),
+                                                 bucket_count, options_, hash_,
+                                                 equal_to_);
+                      new_table.MoveFrom(std::move(*this));
+                      *this = std::move(new_table);
+                    });
+  }
+
+  // Move the contents of "other" over to this table. "other" is left with no
+  // slots.
   void MoveFrom(InlinedHashTable&& other) {
     assert(size_ == 0);
-    for (Elem& e : other) {
-      IndexType index;
-      const Key& key = GetKey::Get(e);
-      if (IsEmptyKey(key) || IsDeletedKey(key)) continue;
-      if (Find(key, hash_(key), &index)) {
-        abort();
+    other.ForEachUsedSlot([this, &other](IndexType i) {
+      Elem* e = other.MutableElem(i);
+      const Key& key = GetKey::Get(*e);
+      if (IsEmptyKey(key) || IsDeletedKey(key)) return;
+      const IndexType index = FindEmptySlot(hash_(key));
+      if (kTriviallyRelocatable) {
+        // The source slot is dropped by DestroySlots() below without running
+        // any destructor, so a bitwise copy relocates the element.
+        memcpy(static_cast<void*>(MutableElem(index)), e, sizeof(Elem));
+        MarkUsed(index);
+      } else {
+        MoveElem(index, std::move(*e));
+        other.DestroyElem(i, options_.EmptyKey());
       }
-      *MutableElem(index) = std::move(e);
       --num_free_slots();
-    }
+    });
     size_ = other.size_;
+    other.DestroySlots();
   }
 
   class iterator {
@@ -172,7 +265,7 @@ class InlinedHashTable {
     const Elem* operator->() const { return &table_->GetElem(index_); }
 
     const_iterator operator++() {  // ++it
-      index_ = table_->NextValidElement(table_->array_, index_ + 1);
+      index_ = table_->NextValidElement(index_ + 1);
       return *this;
     }
 
@@ -199,7 +292,7 @@ class InlinedHashTable {
 
   iterator find(const Key& k) {
     IndexType index;
-    if (Find(k, hash_(k), &index)) {
+    if (SampledFind(k, &index)) {
       return iterator(this, index);
     } else {
       return end();
@@ -208,7 +301,7 @@ class InlinedHashTable {
 
   const_iterator find(const Key& k) const {
     IndexType index;
-    if (Find(k, hash_(k), &index)) {
+    if (SampledFind(k, &index)) {
       return const_iterator(this, index);
     } else {
       return cend();
@@ -218,52 +311,92 @@ class InlinedHashTable {
   // Erases the element pointed to by "i". Returns the iterator to the next
   // valid element.
   iterator Erase(iterator i) {
-    Elem& elem = *i;
-    *GetKey::Mutable(&elem) = options_.DeletedKey();
+    DestroyElem(i.index_, options_.DeletedKey());
     --size_;
     return iterator(this, NextValidElement(i.index_ + 1));
   }
 
   // If "k" exists in the table, erase it and return 1. Else return 0.
   IndexType Erase(const Key& k) {
-    iterator i = find(k);
-    if (i == end()) return 0;
-    Erase(i);
-    return 1;
+    IndexType index;
+    if (!HashTableShouldSample(options_)) {
+      if (!Find(k, hash_(k), &index)) return 0;
+      Erase(iterator(this, index));
+      return 1;
+    }
+    int probes;
+    const uint64_t start = HashTableCycles();
+    const bool found = Find(k, hash_(k), &index, &probes);
+    if (found) Erase(iterator(this, index));
+    HashTableRecordSample(
+        HashTableSample::ERASE,
+        found ? HashTableSample::HIT : HashTableSample::MISS, probes,
+        HashTableCycles() - start);
+    return found ? 1 : 0;
   }
 
   bool Empty() const { return size_ == 0; }
   IndexType Size() const { return size_; }
   IndexType Capacity() const { return capacity_mask_ + 1; }
 
-  // Return the mutable pointer to the index'th slot in array.
+  // Return the mutable pointer to the index'th slot in array. If the slot is
+  // empty or a tombstone, only the key of the returned element is valid.
   Elem* MutableElem(IndexType index) {
-    if (index < NumInlinedElements) {
-      return &inlined()[index];
+    return reinterpret_cast<Elem*>(&Slots()[index]);
+  }
+
+  // Construct an element in the index'th slot, which must have just been
+  // claimed by Insert(), from "args". If the constructor throws, the slot and
+  // the counts are restored to their state before Insert().
+  template <typename... Args>
+  Elem* ConstructElem(IndexType index, Args&&... args) {
+    Elem* elem = MutableElem(index);
+    Key* key = GetKey::Mutable(elem);
+    const bool was_tombstone = IsDeletedKey(*key);
+    key->~Key();
+    MarkUsed(index);
+    try {
+      return new (elem) Elem(std::forward<Args>(args)...);
+    } catch (...) {
+      new (key) Key(options_.EmptyKey());
+      if (was_tombstone) {
+        SfinaeSetDeletedKey(key, &options_);
+      } else {
+        ClearUsed(index);
+        ++num_free_slots();
+      }
+      --size_;
+      throw;
     }
-    return &outlined_[index - NumInlinedElements];
   }
 
-  // Return the index'th slot in array.
+  // Return the index'th slot in array. If the slot is empty or a tombstone,
+  // only the key of the returned element is valid.
   const Elem& GetElem(IndexType index) const {
-    if (index < NumInlinedElements) {
-      return inlined()[index];
-    }
-    return outlined_[index - NumInlinedElements];
+    return ElemAt(Slots(), index);
   }
 
   // Find "k" in the array. If found, set *index to the location of the key in
-  // the array.
-  bool Find(const Key& k, size_t hash, IndexType* index) const {
+  // the array. If "probes" is non-null, set *probes to the number of slots
+  // examined.
+  bool Find(const Key& k, size_t hash, IndexType* index,
+            int* probes = nullptr) const {
+    if (probes != nullptr) *probes = 0;
     if (Capacity() == 0) return false;
+    const Slot* slots = Slots();
+    const uint64_t* overflow = OverflowBits();
     *index = Clamp(hash);
     for (int retries = 1;; ++retries) {
-      const Elem& elem = GetElem(*index);
+      if (probes != nullptr) *probes = retries;
+      const Elem& elem = ElemAt(slots, *index);
       const Key& key = GetKey::Get(elem);
       if (equal_to_(key, k)) {
         return true;
       } else if (IsEmptyKey(key)) {
         return false;
+      } else if (overflow != nullptr && !TestOverflow(overflow, *index)) {
+        // No key probed past this slot.
+        return false;
       }
       if (retries > Capacity()) {
         return false;
@@ -279,10 +412,12 @@ class InlinedHashTable {
   InsertResult Insert(const Key& k, size_t hash, IndexType* index) {
     constexpr IndexType kInvalidIndex = std::numeric_limits<IndexType>::max();
     if (Capacity() == 0) return ARRAY_FULL;
+    const Slot* slots = Slots();
+    uint64_t* overflow = OverflowBits();
     *index = Clamp(hash);
     IndexType empty_index = kInvalidIndex;
     for (int retries = 1;; ++retries) {
-      const Elem& elem = GetElem(*index);
+      const Elem& elem = ElemAt(slots, *index);
       const Key& key = GetKey::Get(elem);
       if (equal_to_(key, k)) {
         return KEY_FOUND;
@@ -306,26 +441,192 @@ class InlinedHashTable {
       if (retries > Capacity()) {
         return ARRAY_FULL;
       }
+      if (overflow != nullptr) SetOverflow(overflow, *index);
       *index = Probe(*index, retries);
     }
   }
 
-  void Clear() {
-    for (Elem& elem : inlined()) {
-      *GetKey::Mutable(&elem) = options_.EmptyKey();
+  // Insert(), expanding the table if it's full. Never returns ARRAY_FULL.
+  InsertResult InsertOrExpand(const Key& k, IndexType* index) {
+    if (!HashTableShouldSample(options_)) {
+      return InsertOrExpand(k, hash_(k), index);
     }
-    if (outlined_ != nullptr) {
-      for (size_t i = 0; i < Capacity() - inlined().size(); ++i) {
-        *GetKey::Mutable(&outlined_[i]) = options_.EmptyKey();
-      }
+    const IndexType old_capacity = Capacity();
+    const uint64_t start = HashTableCycles();
+    const size_t hash = hash_(k);
+    const InsertResult result = InsertOrExpand(k, hash, index);
+    const uint64_t cycles = HashTableCycles() - start;
+    HashTableSample::Result sample_result = HashTableSample::HIT;
+    if (result != KEY_FOUND) {
+      sample_result = Capacity() == old_capacity ? HashTableSample::MISS
+                                                 : HashTableSample::GROW;
     }
+    HashTableRecordSample(HashTableSample::INSERT, sample_result,
+                          ProbeLength(*index, hash), cycles);
+    return result;
+  }
+
+  void Clear() {
+    ForEachUsedSlot([this](IndexType i) {
+      Elem* elem = MutableElem(i);
+      const Key& key = GetKey::Get(*elem);
+      if (IsEmptyKey(key)) return;
+      if (IsDeletedKey(key)) {
+        *GetKey::Mutable(elem) = options_.EmptyKey();
+      } else {
+        DestroyElem(i, options_.EmptyKey());
+      }
+    });
+    ResetMetadata();
     size_ = 0;
-    num_free_slots() = Capacity();
+    num_free_slots() = Capacity() * MaxLoadFactor();
   }
 
   const Options& options() const { return options_; }
   const Hash& hash() const { return hash_; }
   const EqualTo& equal_to() const { return equal_to_; }
+  // Returns the value of Options::MaxLoadFactor(), or 0.5 if it's not defined.
+  double MaxLoadFactor() const { return SfinaeMaxLoadFactor(&options_); }
+
+  // Takes O(Capacity() * kProbeLengthBuckets) time, or O(# of used slots *
+  // kProbeLengthBuckets) with the occupancy bitmap, and doesn't allocate
+  // memory.
+  InlinedHashTableStats GetStats() const {
+    using Stats = InlinedHashTableStats;
+    Stats stats;
+    stats.size = size_;
+    stats.capacity = Capacity();
+    if (Capacity() > 0) {
+      stats.load_factor = static_cast<double>(size_) / Capacity();
+    }
+    int64_t total_probe_length = 0;
+    ForEachUsedSlot([this, &stats, &total_probe_length](IndexType i) {
+      const Key& key = GetKey::Get(GetElem(i));
+      if (IsEmptyKey(key)) return;
+      if (IsDeletedKey(key)) {
+        ++stats.num_tombstones;
+        return;
+      }
+      const int length = ProbeLength(i, hash_(key), Stats::kProbeLengthBuckets);
+      ++stats.probe_length_histogram[length - 1];
+      total_probe_length += length;
+      stats.max_probe_length = std::max(stats.max_probe_length, length);
+    });
+    if (size_ == 0) return stats;
+    stats.mean_probe_length = static_cast<double>(total_probe_length) / size_;
+    const size_t rank = (size_ * 99 + 99) / 100;
+    size_t seen = 0;
+    for (int i = 0; i < Stats::kProbeLengthBuckets; ++i) {
+      seen += stats.probe_length_histogram[i];
+      if (seen >= rank) {
+        stats.p99_probe_length = i + 1;
+        break;
+      }
+    }
+    return stats;
+  }
+
+  // Backdoor methods used by hash_table_snapshot.h. Slots [0, Capacity())
+  // are stored contiguously in Elems().
+  const Elem* Elems() const { return reinterpret_cast<const Elem*>(Slots()); }
+  IndexType NumFreeSlots() const { return num_free_slots(); }
+
+  // Backdoor method used by HashTableRegistry. Takes O(1) time.
+  HashTableRegistry::Usage RegistryUsage() const {
+    HashTableRegistry::Usage usage;
+    usage.size = size_;
+    usage.capacity = Capacity();
+    // Every slot taken from num_free_slots() since the last reset holds
+    // either an element or a tombstone. The counts may be briefly
+    // inconsistent, e.g., while a table is being deserialized, so clamp at
+    // zero instead of underflowing.
+    const size_t usable_slots =
+        static_cast<IndexType>(Capacity() * MaxLoadFactor());
+    const size_t untaken_slots =
+        static_cast<size_t>(num_free_slots()) + static_cast<size_t>(size_);
+    usage.num_tombstones =
+        usable_slots > untaken_slots ? usable_slots - untaken_slots : 0;
+    usage.inlined_bytes = sizeof(*this);
+    if (outlined_ != nullptr) {
+      usage.outlined_bytes = NumOutlinedSlots(Capacity()) * sizeof(Slot);
+    }
+    return usage;
+  }
+
+  // Backdoor method used by the benchmarks. Returns the number of slots that
+  // Find() visits to reach the element in the index'th slot.
+  int ProbeLength(IndexType index) const {
+    return ProbeLength(index, hash_(GetKey::Get(GetElem(index))));
+  }
+  // Same as above, but "hash" is the hash of the key in the index'th slot,
+  // which may not be constructed yet. Gives up and returns "max_length" once
+  // the probe reaches that many slots.
+  int ProbeLength(IndexType index, size_t hash,
+                  int max_length = std::numeric_limits<int>::max()) const {
+    IndexType i = Clamp(hash);
+    int length = 1;
+    for (; i != index && length < max_length; ++length) i = Probe(i, length);
+    return length;
+  }
+
+  // Backdoor methods used by hash_table_serializer.h to rebuild a table slot
+  // by slot.
+  //
+  // ResetCapacity discards all the elements and resizes the table to exactly
+  // "capacity" slots. "capacity" must be zero or a power of two, and must be
+  // at least NumInlinedElements.
+  void ResetCapacity(IndexType capacity) {
+    DestroySlots();
+    size_ = 0;
+    capacity_mask_ = capacity - 1;
+    assert((capacity & capacity_mask_) == 0);
+    num_free_slots() = capacity * MaxLoadFactor();
+    if (Capacity() > NumInlinedElements) {
+      outlined_.reset(new Slot[NumOutlinedSlots(Capacity())]);
+      ResetMetadata();
+    } else {
+      outlined_.reset();
+    }
+    for (IndexType i = 0; i < Capacity(); ++i) {
+      new (GetKey::Mutable(MutableElem(i))) Key(options_.EmptyKey());
+    }
+  }
+  bool IsEmptySlot(IndexType index) const {
+    return IsEmptyKey(GetKey::Get(GetElem(index)));
+  }
+  bool IsTombstoneSlot(IndexType index) const {
+    return IsDeletedKey(GetKey::Get(GetElem(index)));
+  }
+  // Store "elem" in the index'th slot, which must be empty. If "verify",
+  // returns false, storing nothing, if the key is the empty or the deleted
+  // key, or if the slot isn't on the key's probe sequence. Else, hashes the
+  // key only to set the overflow bits.
+  bool RestoreElem(IndexType index, Elem&& elem, bool verify) {
+    assert(IsEmptySlot(index));
+    const Key& key = GetKey::Get(elem);
+    if (verify && (IsEmptyKey(key) || IsDeletedKey(key))) return false;
+    uint64_t* overflow = OverflowBits();
+    if (verify || overflow != nullptr) {
+      // Replay the probes that the original insertion made.
+      IndexType i = Clamp(hash_(key));
+      for (IndexType retries = 1; i != index; ++retries) {
+        if (retries > Capacity()) return false;
+        if (overflow != nullptr) SetOverflow(overflow, i);
+        i = Probe(i, retries);
+      }
+    }
+    MoveElem(index, std::move(elem));
+    ++size_;
+    return true;
+  }
+  // Mark the index'th slot, which must be empty, as a tombstone. Returns
+  // false if Options doesn't define DeletedKey().
+  bool RestoreTombstone(IndexType index) {
+    assert(IsEmptySlot(index));
+    MarkUsed(index);
+    return SfinaeSetDeletedKey(GetKey::Mutable(MutableElem(index)), &options_);
+  }
+  void RestoreNumFreeSlots(IndexType n) { num_free_slots() = n; }
 
   IndexType ComputeCapacity(IndexType desired) {
     if (desired == 1 && NumInlinedElements == 0) {
@@ -341,8 +642,327 @@ class InlinedHashTable {
   }
 
  private:
-  using InlinedArray = std::array<Elem, NumInlinedElements>;
+  struct UnregisteredTag {};
+
+  // Construct a table that HashTableRegistry doesn't see. Used directly only
+  // for the temporary table in Expand().
+  InlinedHashTable(UnregisteredTag, IndexType bucket_count,
+                   const Options& options, const Hash& hash,
+                   const EqualTo& equal_to)
+      : size_(0),
+        capacity_mask_(kNoSlots),
+        options_(options),
+        hash_(hash),
+        equal_to_(equal_to) {
+    ResetCapacity(ComputeCapacity(bucket_count));
+  }
+
+  // Uninitialized storage for one element. Every slot in [0, Capacity())
+  // holds either a constructed Elem, or, if the slot is empty or a tombstone,
+  // just a constructed Key at GetKey::Mutable(). The rest of the slot is left
+  // uninitialized, so values are constructed only on insertion.
+  using Slot = typename std::aligned_storage<sizeof(Elem), alignof(Elem)>::type;
+  using InlinedArray = std::array<Slot, NumInlinedElements>;
   static constexpr IndexType kEnd = std::numeric_limits<IndexType>::max();
+  // Value of capacity_mask_ for a table with no slots.
+  static constexpr IndexType kNoSlots = static_cast<IndexType>(-1);
+  // If true, slots are copied and relocated with memcpy instead of running
+  // the constructors and destructors of Elem.
+  static constexpr bool kTriviallyRelocatable =
+      std::is_trivially_copy_constructible<Elem>::value &&
+      std::is_trivially_destructible<Elem>::value;
+
+  // Move "elem" into the index'th slot, which must be empty. Unlike
+  // ConstructElem(), doesn't touch the counts.
+  void MoveElem(IndexType index, Elem&& elem) {
+    Elem* dest = MutableElem(index);
+    GetKey::Mutable(dest)->~Key();
+    MarkUsed(index);
+    new (dest) Elem(std::move(elem));
+  }
+
+  // Destroy the element in the index'th slot and replace it with "key", which
+  // is either the empty key or the deleted key.
+  void DestroyElem(IndexType index, const Key& key) {
+    Elem* elem = MutableElem(index);
+    elem->~Elem();
+    new (GetKey::Mutable(elem)) Key(key);
+  }
+
+  // Find an empty slot for a key with the given hash, which must not be in
+  // the table. Used when rehashing, so the table has no tombstones.
+  IndexType FindEmptySlot(size_t hash) {
+    const Slot* slots = Slots();
+    uint64_t* overflow = OverflowBits();
+    IndexType index = Clamp(hash);
+    for (IndexType retries = 1;; ++retries) {
+      if (IsEmptyKey(GetKey::Get(ElemAt(slots, index)))) return index;
+      assert(retries <= Capacity());
+      if (overflow != nullptr) SetOverflow(overflow, index);
+      index = Probe(index, retries);
+    }
+  }
+
+  InsertResult InsertOrExpand(const Key& k, size_t hash, IndexType* index) {
+    InsertResult result = Insert(k, hash, index);
+    if (result != ARRAY_FULL) return result;
+
+    Expand(size_ + 1);
+    result = Insert(k, hash, index);
+    assert(result == EMPTY_SLOT_FOUND);
+    return result;
+  }
+
+  // Find() that records one in Options::SampleEvery() calls.
+  bool SampledFind(const Key& k, IndexType* index) const {
+    if (!HashTableShouldSample(options_)) return Find(k, hash_(k), index);
+    int probes;
+    const uint64_t start = HashTableCycles();
+    const bool found = Find(k, hash_(k), index, &probes);
+    HashTableRecordSample(
+        HashTableSample::FIND,
+        found ? HashTableSample::HIT : HashTableSample::MISS, probes,
+        HashTableCycles() - start);
+    return found;
+  }
+
+  // Returns the value of Options::UseOccupancyBitmap(), or false if it's not
+  // defined.
+  bool UseOccupancyBitmap() const {
+    return SfinaeUseOccupancyBitmap(&options_);
+  }
+  // Returns the value of Options::UseOverflowBits(), or false if it's not
+  // defined.
+  bool UseOverflowBits() const { return SfinaeUseOverflowBits(&options_); }
+
+  static IndexType NumBitmapWords(IndexType capacity) {
+    return (capacity + 63) / 64;
+  }
+
+  // Returns the array of Capacity() slots. A table with at most
+  // NumInlinedElements slots stores them in inlined(). A larger one stores
+  // all of them in outlined_, so that a slot is always addressed as
+  // Slots()[index], without comparing the index against NumInlinedElements.
+  Slot* Slots() {
+    return outlined_ != nullptr ? outlined_.get() : inlined().data();
+  }
+  const Slot* Slots() const {
+    return outlined_ != nullptr ? outlined_.get() : inlined().data();
+  }
+  static const Elem& ElemAt(const Slot* slots, IndexType index) {
+    return reinterpret_cast<const Elem&>(slots[index]);
+  }
+
+  // The occupancy bitmap and the overflow bits, whichever are enabled, are
+  // stored in this order in the metadata. Only tables with outlined slots
+  // have the metadata.
+  IndexType NumMetadataWords(IndexType capacity) const {
+    return (UseOccupancyBitmap() ? NumBitmapWords(capacity) : 0) +
+           (UseOverflowBits() ? NumBitmapWords(capacity) : 0);
+  }
+
+  // Returns true if the metadata of a table with "capacity" outlined slots is
+  // stored in inlined(), which such a table doesn't otherwise use. Else it's
+  // stored after the slots in outlined_.
+  bool MetadataIsInlined(IndexType capacity) const {
+    return alignof(Slot) >= alignof(uint64_t) &&
+           NumMetadataWords(capacity) * sizeof(uint64_t) <=
+               sizeof(InlinedArray);
+  }
+
+  // Byte offset of the metadata from the start of outlined_, when it's not
+  // inlined.
+  static size_t MetadataOffset(IndexType capacity) {
+    const size_t bytes = capacity * sizeof(Slot);
+    return (bytes + alignof(uint64_t) - 1) & ~(alignof(uint64_t) - 1);
+  }
+
+  // Number of Slots to allocate in outlined_ for a table with "capacity"
+  // slots, including the space for the metadata.
+  IndexType NumOutlinedSlots(IndexType capacity) const {
+    const IndexType num_words = NumMetadataWords(capacity);
+    if (num_words == 0 || MetadataIsInlined(capacity)) return capacity;
+    const size_t bytes =
+        MetadataOffset(capacity) + num_words * sizeof(uint64_t);
+    return (bytes + sizeof(Slot) - 1) / sizeof(Slot);
+  }
+
+  uint64_t* Metadata() {
+    if (MetadataIsInlined(Capacity())) {
+      return reinterpret_cast<uint64_t*>(inlined().data());
+    }
+    return reinterpret_cast<uint64_t*>(
+        reinterpret_cast<char*>(outlined_.get()) + MetadataOffset(Capacity()));
+  }
+  const uint64_t* Metadata() const {
+    return const_cast<InlinedHashTable*>(this)->Metadata();
+  }
+
+  void ResetMetadata() {
+    const IndexType num_words = NumMetadataWords(Capacity());
+    // Without metadata, Metadata() may be null, e.g., inlined() with
+    // NumInlinedElements == 0.
+    if (outlined_ == nullptr || num_words == 0) return;
+    memset(Metadata(), 0, num_words * sizeof(uint64_t));
+  }
+
+  // Returns the occupancy bitmap, or nullptr if the table doesn't have one.
+  // Bit i is set if slot i has been filled since the last Clear(). The slot
+  // may have been erased since.
+  uint64_t* Bitmap() {
+    if (!UseOccupancyBitmap() || outlined_ == nullptr) return nullptr;
+    return Metadata();
+  }
+  const uint64_t* Bitmap() const {
+    return const_cast<InlinedHashTable*>(this)->Bitmap();
+  }
+
+  // Returns the overflow bits, or nullptr if the table doesn't have them. Bit
+  // i is set if an insertion has probed past slot i since the last Clear().
+  uint64_t* OverflowBits() {
+    if (!UseOverflowBits() || outlined_ == nullptr) return nullptr;
+    return Metadata() +
+           (UseOccupancyBitmap() ? NumBitmapWords(Capacity()) : 0);
+  }
+  const uint64_t* OverflowBits() const {
+    return const_cast<InlinedHashTable*>(this)->OverflowBits();
+  }
+  static void SetOverflow(uint64_t* overflow, IndexType index) {
+    overflow[index / 64] |= uint64_t(1) << (index % 64);
+  }
+  static bool TestOverflow(const uint64_t* overflow, IndexType index) {
+    return (overflow[index / 64] >> (index % 64)) & 1;
+  }
+
+  void MarkUsed(IndexType index) {
+    if (uint64_t* bitmap = Bitmap()) {
+      bitmap[index / 64] |= uint64_t(1) << (index % 64);
+    }
+  }
+  void ClearUsed(IndexType index) {
+    if (uint64_t* bitmap = Bitmap()) {
+      bitmap[index / 64] &= ~(uint64_t(1) << (index % 64));
+    }
+  }
+
+  // Call fn(index) for every slot that may be non-empty. Without a bitmap,
+  // that's every slot in the table.
+  template <typename Fn>
+  void ForEachUsedSlot(Fn fn) const {
+    if (const uint64_t* bitmap = Bitmap()) {
+      const IndexType num_words = NumBitmapWords(Capacity());
+      for (IndexType w = 0; w < num_words; ++w) {
+        for (uint64_t word = bitmap[w]; word != 0; word &= word - 1) {
+          fn(w * 64 + __builtin_ctzll(word));
+        }
+      }
+      return;
+    }
+    for (IndexType i = 0; i < Capacity(); ++i) fn(i);
+  }
+
+  // Destroy all the objects in the slots, and leave the table with no slots.
+  void DestroySlots() {
+    if (!std::is_trivially_destructible<Elem>::value) {
+      auto destroy = [this](IndexType i) {
+        Elem* elem = MutableElem(i);
+        const Key& key = GetKey::Get(*elem);
+        if (IsEmptyKey(key) || IsDeletedKey(key)) {
+          GetKey::Mutable(elem)->~Key();
+        } else {
+          elem->~Elem();
+        }
+      };
+      if (std::is_trivially_destructible<Key>::value) {
+        // Unused slots hold only a key, which needs no destruction.
+        ForEachUsedSlot(destroy);
+      } else {
+        for (IndexType i = 0; i < Capacity(); ++i) destroy(i);
+      }
+    }
+    outlined_.reset();
+    capacity_mask_ = kNoSlots;
+    size_ = 0;
+  }
+
+  // Copy the slots of "other" to this table.
+  //
+  // REQUIRES: this table has no slots.
+  void CopySlotsFrom(const InlinedHashTable& other) {
+    assert(Capacity() == 0);
+    size_ = other.size_;
+    capacity_mask_ = other.capacity_mask_;
+    num_free_slots() = other.num_free_slots();
+    if (Capacity() > inlined().size()) {
+      outlined_.reset(new Slot[NumOutlinedSlots(Capacity())]);
+    }
+    const IndexType num_words = NumMetadataWords(Capacity());
+    if (outlined_ != nullptr && num_words != 0) {
+      memcpy(Metadata(), other.Metadata(), num_words * sizeof(uint64_t));
+    }
+    if (kTriviallyRelocatable) {
+      if (Capacity() > 0) {
+        memcpy(Slots(), other.Slots(), Capacity() * sizeof(Slot));
+      }
+      return;
+    }
+    for (IndexType i = 0; i < Capacity(); ++i) {
+      const Elem& elem = other.GetElem(i);
+      const Key& key = GetKey::Get(elem);
+      if (IsEmptyKey(key) || IsDeletedKey(key)) {
+        new (GetKey::Mutable(MutableElem(i))) Key(key);
+      } else {
+        new (MutableElem(i)) Elem(elem);
+      }
+    }
+  }
+
+  // Move the slots of "other" to this table. "other" is left empty with
+  // NumInlinedElements slots.
+  //
+  // REQUIRES: this table has no slots.
+  void StealSlotsFrom(InlinedHashTable&& other) {
+    assert(Capacity() == 0);
+    size_ = other.size_;
+    capacity_mask_ = other.capacity_mask_;
+    num_free_slots() = other.num_free_slots();
+    outlined_ = std::move(other.outlined_);
+    if (outlined_ != nullptr) {
+      // The slots moved along with outlined_, but the metadata may be in
+      // other.inlined().
+      const IndexType num_words = NumMetadataWords(Capacity());
+      if (num_words != 0 && MetadataIsInlined(Capacity())) {
+        memcpy(inlined().data(), other.inlined().data(),
+               num_words * sizeof(uint64_t));
+      }
+      other.capacity_mask_ = kNoSlots;
+      other.ResetCapacity(NumInlinedElements);
+      return;
+    }
+    // Move the inlined slots individually.
+    if (kTriviallyRelocatable) {
+      if (Capacity() > 0) {
+        memcpy(inlined().data(), other.inlined().data(),
+               Capacity() * sizeof(Slot));
+      }
+      other.capacity_mask_ = kNoSlots;
+      other.ResetCapacity(NumInlinedElements);
+      return;
+    }
+    for (IndexType i = 0; i < Capacity(); ++i) {
+      Elem* elem = other.MutableElem(i);
+      Key* key = GetKey::Mutable(elem);
+      if (IsEmptyKey(*key) || IsDeletedKey(*key)) {
+        new (GetKey::Mutable(MutableElem(i))) Key(std::move(*key));
+        key->~Key();
+      } else {
+        new (MutableElem(i)) Elem(std::move(*elem));
+        elem->~Elem();
+      }
+    }
+    other.capacity_mask_ = kNoSlots;
+    other.ResetCapacity(NumInlinedElements);
+  }
 
   // Compute the next bucket index to probe on collision.
   IndexType Probe(IndexType current, int retries) const {
@@ -352,6 +972,21 @@ class InlinedHashTable {
   // Find the first filled slot at or after "from". For incremenenting an
   // iterator.
   IndexType NextValidElement(IndexType from) const {
+    if (const uint64_t* bitmap = Bitmap()) {
+      for (IndexType i = from; i < Capacity(); ++i) {
+        const uint64_t word = bitmap[i / 64] & (~uint64_t(0) << (i % 64));
+        if (word == 0) {
+          i = (i / 64) * 64 + 63;
+          continue;
+        }
+        i = (i / 64) * 64 + __builtin_ctzll(word);
+        const Key& k = GetKey::Get(GetElem(i));
+        if (!IsEmptyKey(k) && !IsDeletedKey(k)) {
+          return i;
+        }
+      }
+      return kEnd;
+    }
     IndexType i = from;
     for (;;) {
       if (i >= Capacity()) {
@@ -403,6 +1038,15 @@ class InlinedHashTable {
 
   static auto SfinaeIsDeletedKey(...) -> bool { return false; }
 
+  template <typename TOptions>
+  static auto SfinaeSetDeletedKey(Key* k, const TOptions* options)
+      -> decltype(*k = options->DeletedKey(), true) {
+    *k = options->DeletedKey();
+    return true;
+  }
+
+  static auto SfinaeSetDeletedKey(...) -> bool { return false; }
+
   // A template hack to call Options::MaxLoadFactor only when it's defined.
   template <typename TOptions>
   static auto SfinaeMaxLoadFactor(const TOptions* options)
@@ -410,18 +1054,30 @@ class InlinedHashTable {
     return options->MaxLoadFactor();
   }
   static auto SfinaeMaxLoadFactor(...) -> double { return 0.5; }
+
+  template <typename TOptions>
+  static auto SfinaeUseOccupancyBitmap(const TOptions* options)
+      -> decltype(options->UseOccupancyBitmap()) {
+    return options->UseOccupancyBitmap();
+  }
+  static auto SfinaeUseOccupancyBitmap(...) -> bool { return false; }
+
+  template <typename TOptions>
+  static auto SfinaeUseOverflowBits(const TOptions* options)
+      -> decltype(options->UseOverflowBits()) {
+    return options->UseOverflowBits();
+  }
+  static auto SfinaeUseOverflowBits(...) -> bool { return false; }
   bool IsDeletedKey(const Key& k) const {
     return SfinaeIsDeletedKey(&k, &options_, &equal_to_);
   }
-  // Returns the value of Options::MaxLoadFactor(), or 0.5 if it's not defined.
-  double MaxLoadFactor() const { return SfinaeMaxLoadFactor(&options_); }
 
   // Clamp the "v" in the array bucket  index range.
   IndexType Clamp(IndexType v) const { return v & capacity_mask_; }
 
   // # of filled slots.
   IndexType size_;
-  // Capacity-1 of inlined + capacity of outlined. Always a power of two.
+  // Capacity-1. The capacity is zero or a power of two.
   IndexType capacity_mask_;
 
   // Combo of num_free_slots and inlined. num_free_slots is the # of remaining
@@ -433,7 +1089,11 @@ class InlinedHashTable {
   Options options_;
   Hash hash_;
   EqualTo equal_to_;
-  std::unique_ptr<Elem[]> outlined_;
+  // False for the temporary table that Expand() rehashes into, which isn't
+  // registered in HashTableRegistry.
+  bool registered_ = false;
+  // All the slots, if there are more than NumInlinedElements. See Slots().
+  std::unique_ptr<Slot[]> outlined_;
 
   const InlinedArray& inlined() const {
     return num_free_slots_and_inlined_.t1();
@@ -454,6 +1114,10 @@ class InlinedHashMap {
  public:
   using Elem = std::pair<Key, Value>;
   using value_type = Elem;
+  using key_type = Key;
+  using mapped_type = Value;
+  using hasher = Hash;
+  using key_equal = EqualTo;
   struct GetKey {
     static const Key& Get(const Elem& elem) { return elem.first; }
     static Key* Mutable(Elem* elem) { return &elem->first; }
@@ -476,52 +1140,100 @@ class InlinedHashMap {
   const_iterator begin() const { return impl_.cbegin(); }
   const_iterator end() const { return impl_.cend(); }
   IndexType size() const { return impl_.Size(); }
+  Hash hash_function() const { return impl_.hash(); }
+  EqualTo key_eq() const { return impl_.equal_to(); }
   iterator find(const Key& k) { return impl_.find(k); }
   const_iterator find(const Key& k) const { return impl_.find(k); }
 
   std::pair<iterator, bool> insert(Elem&& value) {
     IndexType index;
     typename Table::InsertResult result = Insert(value.first, &index);
-    Elem* slot = impl_.MutableElem(index);
     if (result != Table::KEY_FOUND) {
-      // newly inserted. fill the key.
-      *slot = std::move(value);
+      impl_.ConstructElem(index, std::move(value));
       return std::make_pair(typename Table::iterator(&impl_, index), true);
     }
     return std::make_pair(typename Table::iterator(&impl_, index), false);
   }
 
-  iterator erase(iterator i) { return impl_.erase(i); }
-  IndexType erase(const Key& k) { return impl_.Erase(k); }
-  void clear() { impl_.Clear(); }
-  Value& operator[](const Key& k) {
+  std::pair<iterator, bool> insert(const Elem& value) {
     IndexType index;
-    typename Table::InsertResult result = Insert(k, &index);
-    Elem* slot = impl_.MutableElem(index);
+    typename Table::InsertResult result = Insert(value.first, &index);
     if (result != Table::KEY_FOUND) {
-      // newly inserted. fill the key.
-      slot->first = k;
+      impl_.ConstructElem(index, value);
+      return std::make_pair(typename Table::iterator(&impl_, index), true);
+    }
+    return std::make_pair(typename Table::iterator(&impl_, index), false);
+  }
+
+  // If "k" doesn't exist in the map, insert an element whose value is
+  // constructed in place from "args". Else, do nothing. In particular, "k" and
+  // "args" are not moved from if "k" already exists.
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const Key& k, Args&&... args) {
+    return TryEmplace(k, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(Key&& k, Args&&... args) {
+    return TryEmplace(std::move(k), std::forward<Args>(args)...);
+  }
+
+  // Same as try_emplace(k, v). Unlike std::unordered_map::emplace, it takes
+  // exactly a key and a value, and constructs nothing if "k" already exists.
+  template <typename K, typename V>
+  std::pair<iterator, bool> emplace(K&& k, V&& v) {
+    return TryEmplace(std::forward<K>(k), std::forward<V>(v));
+  }
+
+  // If "k" exists in the map, assign "v" to its value. Else, insert a new
+  // element constructed in place from "k" and "v".
+  template <typename K, typename V>
+  std::pair<iterator, bool> insert_or_assign(K&& k, V&& v) {
+    IndexType index;
+    typename Table::InsertResult result = Insert(k, &index);
+    if (result == Table::KEY_FOUND) {
+      impl_.MutableElem(index)->second = std::forward<V>(v);
+      return std::make_pair(typename Table::iterator(&impl_, index), false);
     }
-    return slot->second;
+    impl_.ConstructElem(index, std::forward<K>(k), std::forward<V>(v));
+    return std::make_pair(typename Table::iterator(&impl_, index), true);
   }
 
+  iterator erase(iterator i) { return impl_.Erase(i); }
+  IndexType erase(const Key& k) { return impl_.Erase(k); }
+  void clear() { impl_.Clear(); }
+  Value& operator[](const Key& k) { return TryEmplace(k).first->second; }
+
   // Non-standard methods, mainly for testing.
   size_t capacity() const { return impl_.Capacity(); }
 
+  // Returns the size, the number of tombstones, and the distribution of the
+  // probe lengths. Cheap enough to call periodically, e.g., from a metrics
+  // exporter: it takes one pass over the slots, follows each probe for at
+  // most InlinedHashTableStats::kProbeLengthBuckets slots, and doesn't
+  // allocate.
+  InlinedHashTableStats GetStats() const { return impl_.GetStats(); }
+
+  // Backdoors for hash_table_snapshot.h and hash_table_serializer.h.
+  const Table& table() const { return impl_; }
+  Table* mutable_table() { return &impl_; }
+
  private:
   typename Table::InsertResult Insert(const Key& key, IndexType* index) {
-    const size_t hash = impl_.hash()(key);
-    typename Table::InsertResult result = impl_.Insert(key, hash, index);
-    if (result != Table::ARRAY_FULL) return result;
-
-    const IndexType new_capacity = impl_.ComputeCapacity(size() + 1);
-    Table new_impl(new_capacity, impl_.options(), impl_.hash(),
-                   impl_.equal_to());
-    new_impl.MoveFrom(std::move(impl_));
-    impl_ = std::move(new_impl);
-    result = impl_.Insert(key, hash, index);
-    assert(result == EMPTY_SLOT_FOUND);
-    return result;
+    return impl_.InsertOrExpand(key, index);
+  }
+
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> TryEmplace(K&& k, Args&&... args) {
+    IndexType index;
+    typename Table::InsertResult result = Insert(k, &index);
+    if (result == Table::KEY_FOUND) {
+      return std::make_pair(typename Table::iterator(&impl_, index), false);
+    }
+    impl_.ConstructElem(index, std::piecewise_construct,
+                        std::forward_as_tuple(std::forward<K>(k)),
+                        std::forward_as_tuple(std::forward<Args>(args)...));
+    return std::make_pair(typename Table::iterator(&impl_, index), true);
   }
 
   Table impl_;
@@ -545,7 +1257,7 @@ class InlinedHashSet {
   InlinedHashSet(IndexType bucket_count, const Options& options = Options(),
                  const Hash& hash = Hash(), const EqualTo& equal_to = EqualTo())
       : impl_(bucket_count, options, hash, equal_to) {}
-  bool empty() const { return impl_.empty(); }
+  bool empty() const { return impl_.Empty(); }
   iterator begin() { return impl_.begin(); }
   iterator end() { return impl_.end(); }
   const_iterator cbegin() const { return impl_.cbegin(); }
@@ -553,41 +1265,37 @@ class InlinedHashSet {
   const_iterator begin() const { return impl_.cbegin(); }
   const_iterator end() const { return impl_.cend(); }
   IndexType size() const { return impl_.Size(); }
+  Hash hash_function() const { return impl_.hash(); }
+  EqualTo key_eq() const { return impl_.equal_to(); }
   std::pair<iterator, bool> insert(Elem&& value) {
     IndexType index;
     typename Table::InsertResult result = Insert(value, &index);
-    Elem* slot = impl_.MutableElem(index);
     if (result != Table::KEY_FOUND) {
-      // newly inserted. fill the key.
-      *slot = std::move(value);
+      impl_.ConstructElem(index, std::move(value));
       return std::make_pair(typename Table::iterator(&impl_, index), true);
     }
     return std::make_pair(typename Table::iterator(&impl_, index), false);
   }
 
   iterator find(const Elem& k) { return impl_.find(k); }
-  const_iterator find(const Elem& k) const { return impl_.Find(k); }
+  const_iterator find(const Elem& k) const { return impl_.find(k); }
   void clear() { impl_.Clear(); }
   iterator erase(iterator i) { return impl_.Erase(i); }
   IndexType erase(const Elem& k) { return impl_.Erase(k); }
 
   // Non-standard methods, mainly for testing.
-  size_t capacity() const { return impl_.capacity(); }
+  size_t capacity() const { return impl_.Capacity(); }
+
+  // Returns the size, the number of tombstones, and the distribution of the
+  // probe lengths. Cheap enough to call periodically, e.g., from a metrics
+  // exporter: it takes one pass over the slots, follows each probe for at
+  // most InlinedHashTableStats::kProbeLengthBuckets slots, and doesn't
+  // allocate.
+  InlinedHashTableStats GetStats() const { return impl_.GetStats(); }
 
  private:
   typename Table::InsertResult Insert(const Elem& elem, IndexType* index) {
-    const size_t hash = impl_.hash()(elem);
-    typename Table::InsertResult result = impl_.Insert(elem, hash, index);
-    if (result != Table::ARRAY_FULL) return result;
-
-    const IndexType new_capacity = impl_.ComputeCapacity(size() + 1);
-    Table new_impl(new_capacity, impl_.options(), impl_.hash(),
-                   impl_.equal_to());
-    new_impl.MoveFrom(std::move(impl_));
-    impl_ = std::move(new_impl);
-    result = impl_.Insert(elem, hash, index);
-    assert(result == EMPTY_SLOT_FOUND);
-    return result;
+    return impl_.InsertOrExpand(elem, index);
   }
   Table impl_;
 };
@@ -2,17 +2,38 @@
 #include <gtest/gtest.h>
 
 #define NDEBUG 1
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <fstream>
 #include <google/dense_hash_map>
 #include <iostream>
 #include <limits>
 #include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "benchmark/benchmark.h"
+#include "frozen_hash_map.h"
+#include "hash_table_instrumentation.h"
+#include "hash_table_serializer.h"
+#include "hash_table_snapshot.h"
+#include "hash_table_trace.h"
 #include "hop_scotch_hash_table.h"
 #include "inlined_hash_table.h"
 
@@ -21,6 +42,252 @@ void ProfilerStart(const char* path);
 void ProfilerStop();
 }
 
+// Memory accounting for the benchmarks. The global operator new and delete
+// below count every allocation made through them. Sizes are measured with
+// malloc_usable_size, so they include the allocator's rounding.
+std::atomic<int64_t> num_allocations;
+std::atomic<int64_t> live_bytes;
+std::atomic<int64_t> peak_live_bytes;
+
+void* CountedAlloc(size_t size) {
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) abort();
+  const int64_t n = malloc_usable_size(p);
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  const int64_t live = live_bytes.fetch_add(n, std::memory_order_relaxed) + n;
+  int64_t peak = peak_live_bytes.load(std::memory_order_relaxed);
+  while (live > peak && !peak_live_bytes.compare_exchange_weak(
+                            peak, live, std::memory_order_relaxed)) {
+  }
+  return p;
+}
+
+void CountedFree(void* p) {
+  if (p == nullptr) return;
+  live_bytes.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+  free(p);
+}
+
+void* operator new(size_t size) { return CountedAlloc(size); }
+void* operator new[](size_t size) { return CountedAlloc(size); }
+void operator delete(void* p) noexcept { CountedFree(p); }
+void operator delete[](void* p) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t) noexcept { CountedFree(p); }
+
+// Measures the allocations made between its construction and the calls to
+// its accessors. Not meaningful if other threads allocate concurrently.
+class AllocationTracker {
+ public:
+  AllocationTracker()
+      : start_allocations_(num_allocations.load(std::memory_order_relaxed)),
+        start_bytes_(live_bytes.load(std::memory_order_relaxed)) {
+    peak_live_bytes.store(start_bytes_, std::memory_order_relaxed);
+  }
+
+  int64_t NumAllocations() const {
+    return num_allocations.load(std::memory_order_relaxed) -
+           start_allocations_;
+  }
+  // Bytes allocated and not yet freed.
+  int64_t LiveBytes() const {
+    return live_bytes.load(std::memory_order_relaxed) - start_bytes_;
+  }
+  // Max value of LiveBytes() so far.
+  int64_t PeakBytes() const {
+    return peak_live_bytes.load(std::memory_order_relaxed) - start_bytes_;
+  }
+
+ private:
+  const int64_t start_allocations_;
+  const int64_t start_bytes_;
+};
+
+// Set by the --perf_counters flag.
+bool enable_perf_counters = false;
+
+// Returns the perf_event_attr config for read misses in "cache".
+constexpr uint64_t PerfCacheReadMiss(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// Hardware performance counters of the calling thread, read with
+// perf_event_open(2). Does nothing unless enable_perf_counters is set. Events
+// that the kernel or the CPU doesn't support are skipped.
+class PerfCounters {
+ public:
+  // Start counting.
+  PerfCounters() {
+    if (!enable_perf_counters) return;
+    for (const Event& event : kEvents) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = event.type;
+      attr.config = event.config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fd < 0) {
+        static bool warned = false;
+        if (!warned) {
+          std::cerr << "perf_event_open(" << event.name
+                    << "): " << strerror(errno) << "\n";
+          warned = true;
+        }
+        continue;
+      }
+      counters_.push_back({event.name, fd});
+    }
+    for (const Counter& c : counters_) {
+      ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  ~PerfCounters() {
+    for (const Counter& c : counters_) close(c.fd);
+  }
+
+  // Stop and restart counting, e.g., around state.PauseTiming() and
+  // state.ResumeTiming().
+  void Pause() {
+    for (const Counter& c : counters_) {
+      ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  void Resume() {
+    for (const Counter& c : counters_) {
+      ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  // Stop counting, and report the counts divided by "num_ops" as counters
+  // named "<event>_per_op".
+  void Report(benchmark::State& state, int64_t num_ops) {
+    Pause();
+    for (const Counter& c : counters_) {
+      // {value, time enabled, time running}.
+      uint64_t values[3];
+      if (read(c.fd, values, sizeof(values)) != sizeof(values)) continue;
+      // Scale up the count if the event was multiplexed with others.
+      const double count =
+          values[2] == 0 ? 0
+                         : static_cast<double>(values[0]) * values[1] /
+                               values[2];
+      state.counters[std::string(c.name) + "_per_op"] =
+          count / std::max<int64_t>(num_ops, 1);
+    }
+  }
+
+ private:
+  struct Event {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+  };
+  static constexpr Event kEvents[] = {
+      {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {"l1d_misses", PERF_TYPE_HW_CACHE,
+       PerfCacheReadMiss(PERF_COUNT_HW_CACHE_L1D)},
+      {"llc_misses", PERF_TYPE_HW_CACHE,
+       PerfCacheReadMiss(PERF_COUNT_HW_CACHE_LL)},
+      {"dtlb_misses", PERF_TYPE_HW_CACHE,
+       PerfCacheReadMiss(PERF_COUNT_HW_CACHE_DTLB)},
+      {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  };
+
+  struct Counter {
+    const char* name;
+    int fd;
+  };
+  std::vector<Counter> counters_;
+};
+
+// Returns a timestamp in CPU cycles, or in nanoseconds on CPUs without rdtsc.
+inline uint64_t ReadCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Returns the number of ReadCycleCounter() ticks per nanosecond.
+double CyclesPerNanosecond() {
+  static const double cycles_per_ns = []() {
+    const auto start_time = std::chrono::steady_clock::now();
+    const uint64_t start = ReadCycleCounter();
+    while (std::chrono::steady_clock::now() - start_time <
+           std::chrono::milliseconds(10)) {
+    }
+    const uint64_t end = ReadCycleCounter();
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start_time;
+    return (end - start) / elapsed.count();
+  }();
+  return cycles_per_ns;
+}
+
+// A histogram of latencies in the style of HdrHistogram. Each power of two is
+// split into kSubBuckets linear buckets, so a recorded value is off by at most
+// 1/kSubBuckets of itself.
+class LatencyHistogram {
+ public:
+  void Record(uint64_t value) {
+    ++counts_[BucketIndex(value)];
+    ++total_;
+    max_ = std::max(max_, value);
+  }
+
+  int64_t TotalCount() const { return total_; }
+  uint64_t Max() const { return max_; }
+
+  // Returns the smallest recorded value v such that "fraction" of the values
+  // are <= v, rounded up to the bucket boundary.
+  uint64_t Percentile(double fraction) const {
+    const int64_t rank = std::ceil(fraction * total_);
+    int64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank && seen > 0) return std::min(BucketLimit(i), max_);
+    }
+    return max_;
+  }
+
+ private:
+  static constexpr int kSubBucketBits = 5;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static constexpr int kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  // Values < kSubBuckets get a bucket each. For larger values, the bucket is
+  // determined by the position of the highest bit and the kSubBucketBits bits
+  // below it.
+  static int BucketIndex(uint64_t value) {
+    if (value < kSubBuckets) return value;
+    const int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+  }
+  // Returns the largest value that falls in the index'th bucket.
+  static uint64_t BucketLimit(int index) {
+    if (index < kSubBuckets) return index;
+    const int shift = index / kSubBuckets - 1;
+    const uint64_t sub_bucket = index % kSubBuckets + kSubBuckets;
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+
+  int64_t counts_[kNumBuckets] = {};
+  int64_t total_ = 0;
+  uint64_t max_ = 0;
+};
+
 template <typename Key>
 class MapOptions {};
 
@@ -46,10 +313,41 @@ using InlinedHash =
     InlinedHashMap<std::string, std::string, 8, MapOptions<std::string>>;
 using HopScotchHash = HopScotchHashMap<std::string, std::string, 8>;
 
+// MapOptions<Key> with the occupancy bitmap.
+template <typename Key>
+class BitmapMapOptions : public MapOptions<Key> {
+ public:
+  constexpr bool UseOccupancyBitmap() const { return true; }
+};
+
+template <>
+class MapOptions<int64_t> {
+ public:
+  constexpr int64_t EmptyKey() const { return -1; };
+  constexpr int64_t DeletedKey() const { return -2; }
+};
+
+// MapOptions<Key> with the overflow bits.
+template <typename Key>
+class OverflowMapOptions : public MapOptions<Key> {
+ public:
+  constexpr bool UseOverflowBits() const { return true; }
+};
+
+using InlinedHashWithBitmap =
+    InlinedHashMap<std::string, std::string, 8, BitmapMapOptions<std::string>>;
+using InlinedHashWithOverflowBits =
+    InlinedHashMap<std::string, std::string, 8,
+                   OverflowMapOptions<std::string>>;
+using HopScotchHashWithBitmap =
+    HopScotchHashMap<std::string, std::string, 8, std::hash<std::string>,
+                     std::equal_to<std::string>, size_t,
+                     BitmapMapOptions<std::string>>;
+
 template <typename Key, typename Value, int NumInlinedBuckets, typename GetKey,
-          typename Hash, typename EqualTo, typename IndexType>
+          typename Hash, typename EqualTo, typename IndexType, typename Options>
 void HopScotchHashTable<Key, Value, NumInlinedBuckets, GetKey, Hash, EqualTo,
-                        IndexType>::CheckConsistency() {
+                        IndexType, Options>::CheckConsistency() {
   const Array& array = array_;
   for (IndexType bi = 0; bi < array.capacity(); ++bi) {
     const Bucket& bucket = array.GetBucket(bi);
@@ -75,7 +373,9 @@ void HopScotchHashTable<Key, Value, NumInlinedBuckets, GetKey, Hash, EqualTo,
 template <typename Map>
 class MapTest : public ::testing::Test {};
 
-typedef ::testing::Types<InlinedHash, HopScotchHash> MyTypes;
+typedef ::testing::Types<InlinedHash, HopScotchHash, InlinedHashWithBitmap,
+                         HopScotchHashWithBitmap, InlinedHashWithOverflowBits>
+    MyTypes;
 
 TYPED_TEST_CASE(MapTest, MyTypes);
 
@@ -102,6 +402,1156 @@ TEST(InlinedHashSetTest, Basic) {
   EXPECT_TRUE(m.find(2) == m.end());
 }
 
+TEST(HashTableSnapshotTest, Basic) {
+  using Map = InlinedHashMap<int, int, 8, MapOptions<int>>;
+  const std::string path = ::testing::TempDir() + "/snapshot_basic";
+  Map m;
+  for (int i = 0; i < 1000; ++i) m[i] = i * 10;
+  for (int i = 0; i < 1000; i += 3) m.erase(i);
+  ASSERT_TRUE(WriteHashTableSnapshot(m, path));
+
+  InlinedHashMapSnapshot<int, int, MapOptions<int>> snapshot;
+  ASSERT_TRUE(snapshot.Open(path));
+  EXPECT_EQ(m.size(), snapshot.size());
+  EXPECT_EQ(m.capacity(), snapshot.capacity());
+  for (int i = 0; i < 1200; ++i) {
+    const std::pair<int, int>* elem = snapshot.find(i);
+    if (i >= 1000 || i % 3 == 0) {
+      EXPECT_TRUE(elem == nullptr) << i;
+    } else {
+      ASSERT_TRUE(elem != nullptr) << i;
+      EXPECT_EQ(i * 10, elem->second);
+    }
+  }
+  EXPECT_FALSE(snapshot.Open(path + ".nonexistent"));
+
+  // A snapshot with a different element type must be rejected.
+  InlinedHashMapSnapshot<int, int64_t, MapOptions<int>> bad;
+  EXPECT_FALSE(bad.Open(path));
+
+  // Empty slots and tombstones are written with zero values.
+  std::ifstream in(path, std::ios::binary);
+  in.seekg(kHashTableSnapshotHeaderSize);
+  std::vector<std::pair<int, int>> slots(m.capacity());
+  ASSERT_TRUE(in.read(reinterpret_cast<char*>(slots.data()),
+                      slots.size() * sizeof(slots[0])));
+  for (const auto& slot : slots) {
+    if (slot.first < 0) {
+      EXPECT_EQ(0, slot.second) << slot.first;
+    }
+  }
+}
+
+TEST(HashTableSnapshotTest, Empty) {
+  const std::string path = ::testing::TempDir() + "/snapshot_empty";
+  InlinedHashMap<int, int, 0, MapOptions<int>> m;
+  ASSERT_TRUE(WriteHashTableSnapshot(m, path));
+  InlinedHashMapSnapshot<int, int, MapOptions<int>> snapshot;
+  ASSERT_TRUE(snapshot.Open(path));
+  EXPECT_TRUE(snapshot.empty());
+  EXPECT_TRUE(snapshot.find(1) == nullptr);
+
+  // capacity * sizeof(Elem) wraps around to the size of the empty file.
+  {
+    std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+    const uint64_t capacity = uint64_t(1) << 61;
+    f.seekp(offsetof(HashTableSnapshotHeader, capacity));
+    f.write(reinterpret_cast<const char*>(&capacity), sizeof(capacity));
+  }
+  EXPECT_FALSE(snapshot.Open(path));
+}
+
+TYPED_TEST(MapTest, Serialize) {
+  TypeParam t;
+  for (int i = 0; i < 1000; ++i) {
+    t[std::to_string(i)] = std::string(i % 50, 'x');
+  }
+  for (int i = 0; i < 1000; i += 7) t.erase(std::to_string(i));
+  std::stringstream stream;
+  ASSERT_TRUE(SerializeHashTable(t, &stream));
+
+  TypeParam t2;
+  t2["garbage"] = "garbage";
+  ASSERT_TRUE(DeserializeHashTable(&stream, &t2));
+  EXPECT_EQ(t.size(), t2.size());
+  EXPECT_EQ(t.capacity(), t2.capacity());
+  EXPECT_TRUE(t2.find("garbage") == t2.end());
+  for (int i = 0; i < 1000; ++i) {
+    auto it = t2.find(std::to_string(i));
+    if (i % 7 == 0) {
+      EXPECT_TRUE(it == t2.end()) << i;
+    } else {
+      ASSERT_TRUE(it != t2.end()) << i;
+      EXPECT_EQ(std::string(i % 50, 'x'), it->second);
+    }
+  }
+  // The restored table must remain usable.
+  t2["new"] = "value";
+  EXPECT_EQ("value", t2["new"]);
+  EXPECT_EQ(t.size() + 1, t2.size());
+
+  std::stringstream truncated(stream.str().substr(0, 100));
+  EXPECT_FALSE(DeserializeHashTable(&truncated, &t2));
+  EXPECT_TRUE(t2.empty());
+}
+
+// Hash without a default constructor.
+struct ScaledHash {
+  explicit ScaledHash(int scale) : scale(scale) {}
+  size_t operator()(int k) const { return static_cast<size_t>(k) * scale; }
+  int scale;
+};
+
+TEST(HashTableTraceTest, KeyHash) {
+  std::stringstream stream;
+  HashTableTraceWriter writer(&stream, HashTableTraceHeader::kKeyHash);
+  TracingHashMap<InlinedHashMap<int, int, 8, MapOptions<int>>> m(&writer);
+  m[1] = 10;
+  m.insert_or_assign(2, 20);
+  EXPECT_TRUE(m.find(1) != m.end());
+  EXPECT_TRUE(m.find(3) == m.end());
+  EXPECT_EQ(1, m.erase(2));
+  m.clear();
+  EXPECT_TRUE(m.empty());
+  ASSERT_TRUE(writer.ok());
+
+  HashTableTraceHeader header;
+  std::vector<HashTableTraceRecord> records;
+  ASSERT_TRUE(ReadHashTableTrace(&stream, &header, &records));
+  EXPECT_EQ(HashTableTraceHeader::kKeyHash, header.key_format);
+  using R = HashTableTraceRecord;
+  ASSERT_EQ(6, records.size());
+  const std::vector<std::pair<R::Op, int>> expected = {
+      {R::kInsert, 1}, {R::kInsert, 2}, {R::kFind, 1},
+      {R::kFind, 3},   {R::kErase, 2},  {R::kClear, 0}};
+  for (size_t i = 0; i < records.size(); ++i) {
+    EXPECT_EQ(expected[i].first, records[i].op) << i;
+    if (records[i].op == R::kClear) continue;
+    EXPECT_EQ(std::hash<int>()(expected[i].second), records[i].key_hash) << i;
+    EXPECT_TRUE(records[i].key_bytes.empty());
+    EXPECT_EQ(records[i].op == R::kInsert ? sizeof(int) : 0,
+              records[i].value_size);
+  }
+}
+
+TEST(HashTableTraceTest, StatefulHash) {
+  std::stringstream stream;
+  HashTableTraceWriter writer(&stream, HashTableTraceHeader::kKeyHash);
+  using Map = InlinedHashMap<int, int, 4, MapOptions<int>, ScaledHash>;
+  TracingHashMap<Map> m(&writer, Map(0, MapOptions<int>(), ScaledHash(7)));
+  m[3] = 30;
+  m.find(5);
+
+  HashTableTraceHeader header;
+  std::vector<HashTableTraceRecord> records;
+  ASSERT_TRUE(ReadHashTableTrace(&stream, &header, &records));
+  ASSERT_EQ(2, records.size());
+  EXPECT_EQ(21, records[0].key_hash);
+  EXPECT_EQ(35, records[1].key_hash);
+}
+
+TEST(HashTableTraceTest, KeyBytes) {
+  std::stringstream stream;
+  HashTableTraceWriter writer(&stream, HashTableTraceHeader::kKeyBytes);
+  TracingHashMap<HopScotchHashMap<std::string, std::string, 8>> m(&writer);
+  m.insert({"hello", "world!"});
+  m.find("hello");
+  m.erase("bye");
+
+  HashTableTraceHeader header;
+  std::vector<HashTableTraceRecord> records;
+  ASSERT_TRUE(ReadHashTableTrace(&stream, &header, &records));
+  EXPECT_EQ(HashTableTraceHeader::kKeyBytes, header.key_format);
+  ASSERT_EQ(3, records.size());
+  std::string key;
+  const char* p = records[0].key_bytes.data();
+  ASSERT_TRUE(HashTableCodec<std::string>::Read(
+      &p, p + records[0].key_bytes.size(), &key));
+  EXPECT_EQ("hello", key);
+  EXPECT_EQ(sizeof(uint32_t) + 6, records[0].value_size);
+  EXPECT_EQ(records[0].key_bytes, records[1].key_bytes);
+  EXPECT_EQ(HashTableTraceRecord::kErase, records[2].op);
+  EXPECT_NE(records[0].key_bytes, records[2].key_bytes);
+
+  const std::string data = stream.str();
+  std::stringstream truncated(data.substr(0, data.size() - 1));
+  EXPECT_FALSE(ReadHashTableTrace(&truncated, &header, &records));
+  std::stringstream garbage("not a trace");
+  EXPECT_FALSE(ReadHashTableTrace(&garbage, &header, &records));
+}
+
+TYPED_TEST(MapTest, Freeze) {
+  TypeParam t;
+  for (int i = 0; i < 10000; ++i) t[std::to_string(i)] = std::to_string(-i);
+  for (int i = 0; i < 10000; i += 5) t.erase(std::to_string(i));
+  const auto frozen = Freeze(t);
+  EXPECT_EQ(t.size(), frozen.size());
+  for (int i = 0; i < 11000; ++i) {
+    auto it = frozen.find(std::to_string(i));
+    if (i >= 10000 || i % 5 == 0) {
+      EXPECT_TRUE(it == frozen.end()) << i;
+    } else {
+      ASSERT_TRUE(it != frozen.end()) << i;
+      EXPECT_EQ(std::to_string(-i), it->second);
+    }
+  }
+  size_t n = 0;
+  for (const auto& elem : frozen) {
+    EXPECT_EQ(t[elem.first], elem.second);
+    ++n;
+  }
+  EXPECT_EQ(t.size(), n);
+}
+
+TEST(FrozenHashMapTest, Small) {
+  for (int n = 0; n < 20; ++n) {
+    InlinedHashMap<int, int, 4, MapOptions<int>> m;
+    for (int i = 0; i < n; ++i) m[i] = i + 1;
+    const auto frozen = Freeze(m);
+    ASSERT_EQ(n, frozen.size());
+    for (int i = 0; i < n; ++i) {
+      ASSERT_TRUE(frozen.find(i) != frozen.end()) << n << " " << i;
+      EXPECT_EQ(i + 1, frozen.find(i)->second);
+    }
+    EXPECT_TRUE(frozen.find(n) == frozen.end());
+  }
+}
+
+// Hash that maps every four consecutive keys to the same value.
+struct CollidingHash {
+  size_t operator()(int k) const { return k / 4; }
+};
+
+TEST(FrozenHashMapTest, CollidingHashes) {
+  InlinedHashMap<int, int, 4, MapOptions<int>, CollidingHash> m;
+  for (int i = 0; i < 1000; ++i) m[i] = i + 1;
+  const auto frozen = Freeze(m);
+  ASSERT_EQ(1000, frozen.size());
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(frozen.find(i) != frozen.end()) << i;
+    EXPECT_EQ(i + 1, frozen.find(i)->second);
+  }
+  for (int i = 1000; i < 1010; ++i) {
+    EXPECT_TRUE(frozen.find(i) == frozen.end()) << i;
+  }
+  int64_t sum = 0;
+  for (const auto& elem : frozen) sum += elem.second;
+  EXPECT_EQ(1000 * 1001 / 2, sum);
+}
+
+TEST(FrozenHashMapTest, StatefulHash) {
+  InlinedHashMap<int, int, 4, MapOptions<int>, ScaledHash> m(
+      0, MapOptions<int>(), ScaledHash(7));
+  HopScotchHashMap<int, int, 4, ScaledHash> h(0, ScaledHash(7));
+  for (int i = 0; i < 100; ++i) {
+    m[i] = i + 1;
+    h[i] = i + 1;
+  }
+  const auto frozen_m = Freeze(m);
+  const auto frozen_h = Freeze(h);
+  EXPECT_EQ(7, frozen_m.hash_function().scale);
+  EXPECT_EQ(7, frozen_h.hash_function().scale);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i + 1, frozen_m.find(i)->second);
+    EXPECT_EQ(i + 1, frozen_h.find(i)->second);
+  }
+}
+
+TYPED_TEST(MapTest, TryEmplace) {
+  TypeParam t;
+  auto r = t.try_emplace("h0", 3, 'x');
+  EXPECT_TRUE(r.second);
+  EXPECT_EQ("h0", r.first->first);
+  EXPECT_EQ("xxx", r.first->second);
+
+  std::string key = "h0";
+  std::string value = "yyy";
+  r = t.try_emplace(std::move(key), std::move(value));
+  EXPECT_FALSE(r.second);
+  EXPECT_EQ("xxx", r.first->second);
+  // Neither the key nor the value is moved from if the key exists.
+  EXPECT_EQ("h0", key);
+  EXPECT_EQ("yyy", value);
+
+  EXPECT_TRUE(t.emplace("h1", "w1").second);
+  EXPECT_FALSE(t.emplace("h1", "w2").second);
+  EXPECT_EQ("w1", t["h1"]);
+  EXPECT_EQ(2, t.size());
+}
+
+TYPED_TEST(MapTest, InsertOrAssign) {
+  TypeParam t;
+  auto r = t.insert_or_assign("h0", "w0");
+  EXPECT_TRUE(r.second);
+  EXPECT_EQ("w0", r.first->second);
+  r = t.insert_or_assign("h0", "w1");
+  EXPECT_FALSE(r.second);
+  EXPECT_EQ("w1", r.first->second);
+  EXPECT_EQ("w1", t["h0"]);
+  EXPECT_EQ(1, t.size());
+}
+
+// Value type that counts the number of times it's constructed with an
+// argument.
+struct CountedValue {
+  static int num_constructions;
+  CountedValue() {}
+  explicit CountedValue(int v) : value(v) { ++num_constructions; }
+  int value = 0;
+};
+int CountedValue::num_constructions = 0;
+
+template <typename Map>
+void TestEmplaceConstructsOnce() {
+  Map m(64);
+  CountedValue::num_constructions = 0;
+  EXPECT_TRUE(m.try_emplace(1, 10).second);
+  EXPECT_EQ(1, CountedValue::num_constructions);
+  EXPECT_FALSE(m.try_emplace(1, 20).second);
+  EXPECT_FALSE(m.emplace(1, 20).second);
+  EXPECT_EQ(1, CountedValue::num_constructions);
+  EXPECT_EQ(10, m.find(1)->second.value);
+}
+
+TEST(EmplaceTest, ConstructsOnce) {
+  TestEmplaceConstructsOnce<
+      InlinedHashMap<int, CountedValue, 8, MapOptions<int>>>();
+  TestEmplaceConstructsOnce<HopScotchHashMap<int, CountedValue, 8>>();
+}
+
+// Value type whose constructors throw while "should_throw" is set.
+struct ThrowingValue {
+  static bool should_throw;
+  ThrowingValue() : ThrowingValue(0) {}
+  explicit ThrowingValue(int v) : value(v) {
+    if (should_throw) throw std::runtime_error("ThrowingValue");
+  }
+  int value;
+};
+bool ThrowingValue::should_throw = false;
+
+template <typename Map>
+void TestThrowingValue() {
+  Map m;
+  for (int i = 0; i < 20; ++i) m.try_emplace(std::to_string(i), i);
+  EXPECT_EQ(1, m.erase("3"));
+  ThrowingValue::should_throw = true;
+  // "3" goes to a tombstone or an empty slot, depending on the hash; the
+  // others go to empty slots.
+  for (const char* k : {"3", "100", "101"}) {
+    EXPECT_THROW(m.try_emplace(k, 1), std::runtime_error);
+    EXPECT_THROW(m[k], std::runtime_error);
+    EXPECT_EQ(19, m.size());
+    EXPECT_TRUE(m.find(k) == m.end());
+  }
+  ThrowingValue::should_throw = false;
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_EQ(i != 3, m.find(std::to_string(i)) != m.end()) << i;
+  }
+  for (int i = 20; i < 200; ++i) m.try_emplace(std::to_string(i), i);
+  EXPECT_EQ(0, m["3"].value);
+  EXPECT_EQ(200, m.size());
+  int n = 0;
+  for (const auto& elem : m) {
+    EXPECT_EQ(elem.first == "3" ? 0 : std::stoi(elem.first),
+              elem.second.value);
+    ++n;
+  }
+  EXPECT_EQ(200, n);
+  m.clear();
+  EXPECT_TRUE(m.empty());
+}
+
+TEST(InlinedHashMapTest, ThrowingValue) {
+  TestThrowingValue<InlinedHashMap<std::string, ThrowingValue, 8,
+                                   MapOptions<std::string>>>();
+  TestThrowingValue<InlinedHashMap<std::string, ThrowingValue, 8,
+                                   BitmapMapOptions<std::string>>>();
+  TestThrowingValue<InlinedHashMap<std::string, ThrowingValue, 0,
+                                   OverflowMapOptions<std::string>>>();
+}
+
+// Value type without a default constructor that tracks the number of live
+// objects.
+struct NoDefaultValue {
+  static int num_live;
+  explicit NoDefaultValue(int v) : value(v) { ++num_live; }
+  NoDefaultValue(const NoDefaultValue& other) : value(other.value) {
+    ++num_live;
+  }
+  NoDefaultValue& operator=(const NoDefaultValue& other) = default;
+  ~NoDefaultValue() { --num_live; }
+  int value;
+};
+int NoDefaultValue::num_live = 0;
+
+TEST(InlinedHashMapTest, NoDefaultConstructor) {
+  NoDefaultValue::num_live = 0;
+  {
+    InlinedHashMap<int, NoDefaultValue, 4, MapOptions<int>> m;
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_TRUE(m.try_emplace(i, i * 10).second);
+    }
+    EXPECT_EQ(100, NoDefaultValue::num_live);
+    for (int i = 0; i < 100; i += 2) {
+      EXPECT_EQ(1, m.erase(i));
+    }
+    EXPECT_EQ(50, NoDefaultValue::num_live);
+    auto copy = m;
+    EXPECT_EQ(100, NoDefaultValue::num_live);
+    EXPECT_EQ(30, copy.find(3)->second.value);
+    auto moved = std::move(copy);
+    EXPECT_EQ(100, NoDefaultValue::num_live);
+    EXPECT_TRUE(copy.empty());
+    EXPECT_EQ(31 * 10, moved.find(31)->second.value);
+    moved.clear();
+    EXPECT_EQ(50, NoDefaultValue::num_live);
+    EXPECT_TRUE(moved.try_emplace(5, 1).second);
+    EXPECT_EQ(51, NoDefaultValue::num_live);
+  }
+  EXPECT_EQ(0, NoDefaultValue::num_live);
+}
+
+// NoDefaultValue can only be decoded with ReadNew().
+template <>
+struct HashTableCodec<NoDefaultValue> {
+  static size_t Size(const NoDefaultValue&) { return sizeof(int); }
+  static void Write(const NoDefaultValue& v, std::ostream* out) {
+    HashTableCodec<int>::Write(v.value, out);
+  }
+  static bool ReadNew(const char** p, const char* limit, void* storage) {
+    int v;
+    if (!HashTableCodec<int>::Read(p, limit, &v)) return false;
+    new (storage) NoDefaultValue(v);
+    return true;
+  }
+};
+
+TEST(HashTableSerializerTest, NoDefaultConstructor) {
+  NoDefaultValue::num_live = 0;
+  {
+    InlinedHashMap<int, NoDefaultValue, 4, MapOptions<int>> m;
+    HopScotchHashMap<int, NoDefaultValue, 4> h;
+    for (int i = 0; i < 100; ++i) {
+      m.try_emplace(i, i * 10);
+      h.try_emplace(i, i * 10);
+    }
+    std::stringstream m_stream;
+    std::stringstream h_stream;
+    ASSERT_TRUE(SerializeHashTable(m, &m_stream));
+    ASSERT_TRUE(SerializeHashTable(h, &h_stream));
+    decltype(m) m2;
+    decltype(h) h2;
+    ASSERT_TRUE(DeserializeHashTable(&m_stream, &m2));
+    ASSERT_TRUE(DeserializeHashTable(&h_stream, &h2));
+    EXPECT_EQ(400, NoDefaultValue::num_live);
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_EQ(i * 10, m2.find(i)->second.value);
+      EXPECT_EQ(i * 10, h2.find(i)->second.value);
+    }
+  }
+  EXPECT_EQ(0, NoDefaultValue::num_live);
+}
+
+// Returns "data" with the header field at "offset" replaced with "value".
+std::string PatchStreamHeader(std::string data, size_t offset,
+                              uint64_t value) {
+  memcpy(&data[offset], &value, sizeof(value));
+  return data;
+}
+
+// Like MapOptions<int>, but with different reserved keys.
+class DifferentEmptyKeyOptions {
+ public:
+  constexpr int EmptyKey() const { return -3; }
+  constexpr int DeletedKey() const { return -4; }
+};
+
+TEST(HashTableSerializerTest, RejectBadHeader) {
+  using Map = InlinedHashMap<int, int, 0, MapOptions<int>>;
+  Map m;
+  for (int i = 0; i < 100; ++i) m[i] = i;
+  std::stringstream stream;
+  ASSERT_TRUE(SerializeHashTable(m, &stream));
+  const std::string data = stream.str();
+
+  auto deserialize = [](const std::string& data) {
+    std::stringstream in(data);
+    Map m2;
+    return DeserializeHashTable(&in, &m2);
+  };
+  EXPECT_TRUE(deserialize(data));
+  const uint64_t kHuge = uint64_t(1) << 60;
+  EXPECT_FALSE(deserialize(PatchStreamHeader(
+      data, offsetof(HashTableStreamHeader, payload_bytes), kHuge)));
+  EXPECT_FALSE(deserialize(PatchStreamHeader(
+      data, offsetof(HashTableStreamHeader, capacity), kHuge)));
+  EXPECT_FALSE(deserialize(PatchStreamHeader(
+      data, offsetof(HashTableStreamHeader, num_records), kHuge)));
+  EXPECT_FALSE(deserialize(PatchStreamHeader(
+      data, offsetof(HashTableStreamHeader, num_free_slots), m.capacity())));
+  EXPECT_FALSE(deserialize(PatchStreamHeader(
+      data, offsetof(HashTableStreamHeader, fingerprint), 0)));
+
+  // A reader with a different empty key can't use the slot positions.
+  std::stringstream in(data);
+  InlinedHashMap<int, int, 0, DifferentEmptyKeyOptions> other;
+  EXPECT_FALSE(DeserializeHashTable(&in, &other));
+}
+
+TEST(HashTableSerializerTest, RejectBadRecords) {
+  using Map = InlinedHashMap<int, int, 0, MapOptions<int>>;
+  Map m(32);
+  for (int i = 0; i < 10; ++i) m[i] = i;
+  ASSERT_EQ(64, m.capacity());
+  std::stringstream stream;
+  ASSERT_TRUE(SerializeHashTable(m, &stream));
+  const std::string data = stream.str();
+  // With std::hash<int>, key i sits in slot i, and the records are (uint64_t
+  // index, uint8_t kind, int key, int value).
+  constexpr size_t kRecordSize = sizeof(uint64_t) + 1 + 2 * sizeof(int);
+  auto patch_record = [&data](int r, size_t offset, int value) {
+    std::string patched = data;
+    memcpy(&patched[sizeof(HashTableStreamHeader) + r * kRecordSize + offset],
+           &value, sizeof(value));
+    return patched;
+  };
+  auto deserialize = [](const std::string& data) {
+    std::stringstream in(data);
+    Map m2;
+    return DeserializeHashTable(&in, &m2);
+  };
+  constexpr size_t kKey = sizeof(uint64_t) + 1;
+  EXPECT_TRUE(deserialize(data));
+  // Reserved keys.
+  EXPECT_FALSE(deserialize(patch_record(3, kKey, -1)));
+  EXPECT_FALSE(deserialize(patch_record(3, kKey, -2)));
+  // Slot 3 holds a second copy of key 2.
+  EXPECT_FALSE(deserialize(patch_record(3, kKey, 2)));
+  // Slot 3 holds key 40, whose probe sequence hits the empty slot 40 first.
+  EXPECT_FALSE(deserialize(patch_record(3, kKey, 40)));
+  // Slot 40 holds key 3; a lookup of 3 stops at the empty slot 10.
+  EXPECT_FALSE(deserialize(patch_record(3, 0, 40)));
+}
+
+// Identity hash that counts its calls.
+struct CountingHash {
+  static int num_calls;
+  size_t operator()(int k) const {
+    ++num_calls;
+    return k;
+  }
+};
+int CountingHash::num_calls = 0;
+
+template <typename Map>
+void TestTrustedStream() {
+  Map m;
+  for (int i = 0; i < 1000; ++i) m[i] = i;
+  std::stringstream stream;
+  ASSERT_TRUE(SerializeHashTable(m, &stream));
+  const std::string data = stream.str();
+  for (HashTableStreamCheck check :
+       {HashTableStreamCheck::kVerify, HashTableStreamCheck::kTrusted}) {
+    std::stringstream in(data);
+    Map m2;
+    CountingHash::num_calls = 0;
+    ASSERT_TRUE(DeserializeHashTable(&in, &m2, check));
+    // The InlinedHashMap header check hashes the empty and the deleted keys.
+    if (check == HashTableStreamCheck::kTrusted) {
+      EXPECT_LE(CountingHash::num_calls, 2);
+    } else {
+      EXPECT_GE(CountingHash::num_calls, 1000);
+    }
+    ASSERT_EQ(1000, m2.size());
+    for (int i = 0; i < 1000; ++i) EXPECT_EQ(i, m2.find(i)->second);
+  }
+}
+
+TEST(HashTableSerializerTest, TrustedStream) {
+  TestTrustedStream<InlinedHashMap<int, int, 4, MapOptions<int>,
+                                   CountingHash>>();
+  TestTrustedStream<HopScotchHashMap<int, int, 4, CountingHash>>();
+}
+
+TEST(HashTableSerializerTest, SparseTable) {
+  InlinedHashMap<int, int, 0, MapOptions<int>> m;
+  HopScotchHashMap<int, int, 0> h;
+  for (int i = 0; i < 100000; ++i) {
+    m[i] = i;
+    h[i] = i;
+  }
+  m.clear();
+  h.clear();
+  m[1] = 10;
+  h[1] = 10;
+  std::stringstream m_stream;
+  std::stringstream h_stream;
+  ASSERT_TRUE(SerializeHashTable(m, &m_stream));
+  ASSERT_TRUE(SerializeHashTable(h, &h_stream));
+  decltype(m) m2;
+  decltype(h) h2;
+  ASSERT_TRUE(DeserializeHashTable(&m_stream, &m2));
+  ASSERT_TRUE(DeserializeHashTable(&h_stream, &h2));
+  EXPECT_LT(m2.capacity(), m.capacity());
+  EXPECT_LT(h2.capacity(), h.capacity());
+  EXPECT_EQ(1, m2.size());
+  EXPECT_EQ(1, h2.size());
+  EXPECT_EQ(10, m2.find(1)->second);
+  EXPECT_EQ(10, h2.find(1)->second);
+}
+
+template <typename Map>
+void TestCopyTriviallyCopyable() {
+  Map m;
+  for (int i = 0; i < 1000; ++i) m[i] = i * 2;
+  for (int i = 0; i < 1000; i += 3) m.erase(i);
+  Map copy(m);
+  EXPECT_EQ(m.size(), copy.size());
+  for (int i = 0; i < 1000; ++i) {
+    auto it = copy.find(i);
+    if (i % 3 == 0) {
+      EXPECT_TRUE(it == copy.end()) << i;
+    } else {
+      ASSERT_TRUE(it != copy.end()) << i;
+      EXPECT_EQ(i * 2, it->second);
+    }
+  }
+  copy[5] = 100;
+  EXPECT_EQ(10, m[5]);
+
+  // Assigning a small map over a large one must drop the large one's slots.
+  Map small;
+  small[1] = 1;
+  copy = small;
+  EXPECT_EQ(1, copy.size());
+  EXPECT_TRUE(copy.find(5) == copy.end());
+  copy = std::move(m);
+  EXPECT_EQ(10, copy[5]);
+  EXPECT_TRUE(m.empty());
+}
+
+TEST(OverflowBitsTest, Miss) {
+  InlinedHashMap<int64_t, int64_t, 0, OverflowMapOptions<int64_t>> m;
+  for (int64_t i = 0; i < 10000; ++i) m[i * 7] = i;
+  for (int64_t i = 0; i < 10000; i += 2) m.erase(i * 7);
+  for (int64_t i = 0; i < 70000; ++i) {
+    auto it = m.find(i);
+    if (i % 14 == 7) {
+      ASSERT_TRUE(it != m.end()) << i;
+      EXPECT_EQ(i / 7, it->second);
+    } else {
+      EXPECT_TRUE(it == m.end()) << i;
+    }
+  }
+  auto copy = m;
+  EXPECT_TRUE(copy.find(7) != copy.end());
+  EXPECT_TRUE(copy.find(14) == copy.end());
+  std::stringstream stream;
+  ASSERT_TRUE(SerializeHashTable(m, &stream));
+  decltype(m) restored;
+  ASSERT_TRUE(DeserializeHashTable(&stream, &restored));
+  for (int64_t i = 0; i < 10000; ++i) {
+    EXPECT_EQ(i % 2 == 1, restored.find(i * 7) != restored.end()) << i;
+  }
+}
+
+// Options with both bitmaps, for int64_t keys.
+class AllMetadataOptions : public OverflowMapOptions<int64_t> {
+ public:
+  constexpr bool UseOccupancyBitmap() const { return true; }
+};
+
+// Check that the elements of "m" are in one array of capacity() slots, and
+// that copies and moves of "m" have the same elements.
+template <typename Map>
+void CheckContiguousSlots(const Map& m, int64_t n) {
+  const auto* elems = m.table().Elems();
+  for (const auto& elem : m) {
+    EXPECT_GE(&elem, elems);
+    EXPECT_LT(&elem, elems + m.capacity());
+  }
+  Map copy(m);
+  Map moved(std::move(copy));
+  ASSERT_EQ(n, moved.size());
+  for (int64_t i = 0; i < n; ++i) {
+    auto it = moved.find(i);
+    ASSERT_TRUE(it != moved.end()) << i;
+    EXPECT_EQ(i * 10, it->second);
+  }
+  EXPECT_TRUE(moved.find(n) == moved.end());
+}
+
+TEST(InlinedHashMapTest, ContiguousSlots) {
+  // With 16 inlined int64_t pairs, the bitmaps fit in the inlined space up to
+  // 1024 slots.
+  InlinedHashMap<int64_t, int64_t, 16, AllMetadataOptions> m;
+  for (int64_t i = 0; i < 2000; ++i) {
+    m[i] = i * 10;
+    if ((i & (i + 1)) == 0) CheckContiguousSlots(m, i + 1);
+  }
+  CheckContiguousSlots(m, 2000);
+  for (int64_t i = 1000; i < 2000; ++i) EXPECT_EQ(1, m.erase(i));
+  CheckContiguousSlots(m, 1000);
+  m.clear();
+  EXPECT_TRUE(m.begin() == m.end());
+  m[0] = 0;
+  CheckContiguousSlots(m, 1);
+}
+
+TEST(InlinedHashMapTest, ProbeLength) {
+  // std::hash<int> is the identity, so the keys collide on slot 0.
+  InlinedHashMap<int, int, 0, MapOptions<int>> m(8);
+  ASSERT_EQ(16, m.capacity());
+  for (int k : {0, 16, 32}) m[k] = k;
+  const auto& table = m.table();
+  std::vector<int> lengths;
+  for (size_t i = 0; i < table.Capacity(); ++i) {
+    if (!table.IsEmptySlot(i)) lengths.push_back(table.ProbeLength(i));
+  }
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), lengths);
+}
+
+TEST(InlinedHashMapTest, Stats) {
+  InlinedHashMap<int, int, 0, MapOptions<int>> m(8);
+  for (int k : {0, 16, 32, 5}) m[k] = k;
+  m.erase(5);
+  m.erase(16);
+  const InlinedHashTableStats stats = m.GetStats();
+  EXPECT_EQ(2, stats.size);
+  EXPECT_EQ(16, stats.capacity);
+  EXPECT_EQ(2, stats.num_tombstones);
+  EXPECT_DOUBLE_EQ(2.0 / 16, stats.load_factor);
+  EXPECT_EQ(1, stats.probe_length_histogram[0]);
+  EXPECT_EQ(0, stats.probe_length_histogram[1]);
+  EXPECT_EQ(1, stats.probe_length_histogram[2]);
+  EXPECT_DOUBLE_EQ(2, stats.mean_probe_length);
+  EXPECT_EQ(3, stats.max_probe_length);
+  EXPECT_EQ(3, stats.p99_probe_length);
+}
+
+TEST(InlinedHashMapTest, StatsLongProbes) {
+  // All the keys collide on slot 0, so the probe lengths are 1 to 100.
+  InlinedHashMap<int, int, 0, MapOptions<int>> m;
+  for (int i = 0; i < 100; ++i) m[i * 1024] = i;
+  ASSERT_LE(m.capacity(), 1024);
+  const InlinedHashTableStats stats = m.GetStats();
+  for (int i = 0; i < InlinedHashTableStats::kProbeLengthBuckets - 1; ++i) {
+    EXPECT_EQ(1, stats.probe_length_histogram[i]) << i;
+  }
+  EXPECT_EQ(69, stats.probe_length_histogram.back());
+  EXPECT_EQ(InlinedHashTableStats::kProbeLengthBuckets, stats.max_probe_length);
+  EXPECT_EQ(InlinedHashTableStats::kProbeLengthBuckets, stats.p99_probe_length);
+}
+
+TEST(HopScotchHashMapTest, Stats) {
+  HopScotchHashMap<int, int, 0> m(16);
+  for (int k : {0, 16, 32, 5}) m[k] = k;
+  m.erase(5);
+  const HopScotchHashTableStats stats = m.GetStats();
+  EXPECT_EQ(3, stats.size);
+  EXPECT_EQ(16, stats.capacity);
+  EXPECT_DOUBLE_EQ(3.0 / 16, stats.load_factor);
+  EXPECT_EQ(1, stats.hop_distance_histogram[0]);
+  EXPECT_EQ(1, stats.hop_distance_histogram[1]);
+  EXPECT_EQ(1, stats.hop_distance_histogram[2]);
+  EXPECT_DOUBLE_EQ(1, stats.mean_hop_distance);
+  EXPECT_EQ(2, stats.max_hop_distance);
+  EXPECT_DOUBLE_EQ(3.0 / 16, stats.max_neighborhood_fill);
+}
+
+class CountingOptions {
+ public:
+  explicit CountingOptions(HopScotchHashTableCounters* counters = nullptr)
+      : counters_(counters) {}
+  HopScotchHashTableCounters* Counters() const { return counters_; }
+
+ private:
+  HopScotchHashTableCounters* counters_;
+};
+
+using CountingHopScotchMap = HopScotchHashMap<int, int, 0, std::hash<int>,
+                                              std::equal_to<int>, size_t,
+                                              CountingOptions>;
+
+TEST(HopScotchHashMapTest, CountersDisplacement) {
+  HopScotchHashTableCounters counters;
+  CountingHopScotchMap m(64, std::hash<int>(), std::equal_to<int>(),
+                         CountingOptions(&counters));
+  // std::hash<int> is the identity. Fill buckets [0, 41).
+  for (int k = 1; k <= 40; ++k) m[k] = k;
+  m[64] = 0;
+  // The first free bucket for key 128 is 41, which is too far from bucket 0,
+  // so one element has to move to bucket 41.
+  m[128] = 0;
+  EXPECT_EQ(64, m.capacity());
+  EXPECT_EQ(42, counters.num_inserts);
+  EXPECT_EQ(1, counters.num_displacements);
+  EXPECT_EQ(1, counters.max_displacements_per_insert);
+  EXPECT_EQ(0, counters.num_expansions());
+  EXPECT_EQ(1, counters.min_expansion_load_factor);
+  for (int k = 1; k <= 40; ++k) EXPECT_EQ(k, m[k]);
+  m.CheckConsistency();
+}
+
+TEST(HopScotchHashMapTest, CountersExpansion) {
+  HopScotchHashTableCounters counters;
+  CountingHopScotchMap m(0, std::hash<int>(), std::equal_to<int>(),
+                         CountingOptions(&counters));
+  m[0] = 0;
+  EXPECT_EQ(1, counters.num_expansions_no_free_bucket);
+  EXPECT_EQ(0, counters.min_expansion_load_factor);
+
+  m = CountingHopScotchMap(32, std::hash<int>(), std::equal_to<int>(),
+                           CountingOptions(&counters));
+  counters = HopScotchHashTableCounters();
+  // All the keys hash to bucket 0, so the 32nd key doesn't fit in its
+  // neighborhood.
+  for (int k = 0; k < 32; ++k) m[k * 32] = k;
+  EXPECT_EQ(64, m.capacity());
+  EXPECT_EQ(32, counters.num_inserts);
+  EXPECT_EQ(0, counters.num_expansions_no_free_bucket);
+  EXPECT_EQ(1, counters.num_expansions_no_closer_bucket);
+  EXPECT_EQ(1, counters.num_expansions());
+  EXPECT_DOUBLE_EQ(31.0 / 32, counters.min_expansion_load_factor);
+  EXPECT_DOUBLE_EQ(31.0 / 32, counters.mean_expansion_load_factor());
+}
+
+// Options that record the resize events in *events.
+class ResizeOptions : public MapOptions<int> {
+ public:
+  explicit ResizeOptions(std::vector<HashTableResizeEvent>* events = nullptr)
+      : events_(events) {}
+  void OnResize(const HashTableResizeEvent& event) const {
+    events_->push_back(event);
+  }
+
+ private:
+  std::vector<HashTableResizeEvent>* events_;
+};
+
+// Check that "events" are START and END pairs that double the capacity up to
+// "capacity", starting at "initial_capacity".
+void CheckResizeEvents(const std::vector<HashTableResizeEvent>& events,
+                       size_t initial_capacity, size_t capacity) {
+  ASSERT_EQ(0, events.size() % 2);
+  ASSERT_FALSE(events.empty());
+  size_t old_capacity = initial_capacity;
+  for (size_t i = 0; i < events.size(); i += 2) {
+    const HashTableResizeEvent& start = events[i];
+    const HashTableResizeEvent& end = events[i + 1];
+    EXPECT_EQ(HashTableResizeEvent::START, start.phase);
+    EXPECT_EQ(HashTableResizeEvent::END, end.phase);
+    EXPECT_EQ(old_capacity, start.old_capacity);
+    EXPECT_EQ(start.old_capacity, end.old_capacity);
+    EXPECT_EQ(start.new_capacity, end.new_capacity);
+    EXPECT_EQ(start.size, end.size);
+    EXPECT_GT(start.new_capacity, start.old_capacity);
+    EXPECT_EQ(0, start.elapsed.count());
+    EXPECT_GE(end.elapsed.count(), 0);
+    old_capacity = start.new_capacity;
+  }
+  EXPECT_EQ(capacity, old_capacity);
+}
+
+TEST(InlinedHashMapTest, OnResize) {
+  std::vector<HashTableResizeEvent> events;
+  InlinedHashMap<int, int, 4, ResizeOptions> m(0, ResizeOptions(&events));
+  for (int i = 0; i < 100; ++i) m[i] = i;
+  CheckResizeEvents(events, 4, m.capacity());
+  EXPECT_EQ(2, events[0].size);  // MaxLoadFactor is 0.5.
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(i, m[i]);
+}
+
+TEST(HopScotchHashMapTest, OnResize) {
+  std::vector<HashTableResizeEvent> events;
+  HopScotchHashMap<int, int, 4, std::hash<int>, std::equal_to<int>, size_t,
+                   ResizeOptions>
+      m(0, std::hash<int>(), std::equal_to<int>(), ResizeOptions(&events));
+  for (int i = 0; i < 100; ++i) m[i] = i;
+  CheckResizeEvents(events, 4, m.capacity());
+  EXPECT_EQ(4, events[0].size);
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(i, m[i]);
+}
+
+// Options that register the table in HashTableRegistry under "tag".
+template <const char* tag>
+class RegistryOptions : public MapOptions<int> {
+ public:
+  const char* RegistryTag() const { return tag; }
+};
+
+char kInlinedRegistryTag[] = "registry_test_inlined";
+char kHopScotchRegistryTag[] = "registry_test_hopscotch";
+
+TEST(InlinedHashMapTest, Registry) {
+  using Map =
+      InlinedHashMap<int, int, 4, RegistryOptions<kInlinedRegistryTag>>;
+  HashTableRegistry* registry = HashTableRegistry::Get();
+  {
+    Map m0;
+    Map m1;
+    for (int i = 0; i < 100; ++i) m1[i] = i;
+    for (int i = 0; i < 100; i += 4) m1.erase(i);
+    const HashTableRegistry::Usage usage =
+        registry->Aggregate()[kInlinedRegistryTag];
+    EXPECT_EQ(2, usage.num_tables);
+    EXPECT_EQ(75, usage.size);
+    EXPECT_EQ(4 + m1.capacity(), usage.capacity);
+    EXPECT_EQ(25, usage.num_tombstones);
+    EXPECT_EQ(2 * sizeof(Map), usage.inlined_bytes);
+    EXPECT_EQ(m1.capacity() * sizeof(std::pair<int, int>),
+              usage.outlined_bytes);
+    {
+      Map m2(m1);
+      EXPECT_EQ(3, registry->Aggregate()[kInlinedRegistryTag].num_tables);
+    }
+    EXPECT_NE(std::string::npos,
+              registry->DumpText().find("registry_test_inlined: tables=2 "
+                                        "size=75 "));
+    EXPECT_NE(std::string::npos,
+              registry->DumpJson().find("\"registry_test_inlined\":{"
+                                        "\"tables\":2,\"size\":75,"));
+  }
+  EXPECT_EQ(0, registry->Aggregate().count(kInlinedRegistryTag));
+}
+
+// Identity hash that records the max number of tables registered under
+// kInlinedRegistryTag at any call.
+struct RegistryCountingHash {
+  static size_t max_tables;
+  size_t operator()(int k) const {
+    max_tables = std::max(max_tables, HashTableRegistry::Get()
+                                          ->Aggregate()[kInlinedRegistryTag]
+                                          .num_tables);
+    return k;
+  }
+};
+size_t RegistryCountingHash::max_tables = 0;
+
+TEST(InlinedHashMapTest, RegistryWhileRestoring) {
+  // A table being deserialized has restored elements but not yet its free
+  // slot count. The registry must not see a negative tombstone count.
+  InlinedHashMap<int, int, 4, RegistryOptions<kInlinedRegistryTag>> m;
+  auto* table = m.mutable_table();
+  table->ResetCapacity(64);
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(table->RestoreElem(i, std::make_pair(i, i), true));
+  }
+  const HashTableRegistry::Usage usage =
+      HashTableRegistry::Get()->Aggregate()[kInlinedRegistryTag];
+  EXPECT_EQ(10, usage.size);
+  EXPECT_EQ(0, usage.num_tombstones);
+}
+
+TEST(InlinedHashMapTest, RegistryExpand) {
+  // The hash is called while Expand() rehashes into its temporary table,
+  // which must not show up in the registry.
+  InlinedHashMap<int, int, 4, RegistryOptions<kInlinedRegistryTag>,
+                 RegistryCountingHash>
+      m;
+  RegistryCountingHash::max_tables = 0;
+  for (int i = 0; i < 100; ++i) m[i] = i;
+  EXPECT_EQ(1, RegistryCountingHash::max_tables);
+}
+
+TEST(HopScotchHashMapTest, Registry) {
+  using Map = HopScotchHashMap<int, int, 4, std::hash<int>, std::equal_to<int>,
+                               size_t, RegistryOptions<kHopScotchRegistryTag>>;
+  HashTableRegistry* registry = HashTableRegistry::Get();
+  {
+    Map m0;
+    for (int i = 0; i < 100; ++i) m0[i] = i;
+    Map m1(std::move(m0));
+    for (int i = 0; i < 100; i += 4) m1.erase(i);
+    const HashTableRegistry::Usage usage =
+        registry->Aggregate()[kHopScotchRegistryTag];
+    EXPECT_EQ(2, usage.num_tables);
+    EXPECT_EQ(75, usage.size);
+    EXPECT_EQ(0, usage.num_tombstones);
+    EXPECT_EQ(2 * sizeof(Map), usage.inlined_bytes);
+    EXPECT_GT(usage.outlined_bytes, 0);
+  }
+  EXPECT_EQ(0, registry->Aggregate().count(kHopScotchRegistryTag));
+}
+
+// RegistryOptions with the occupancy bitmap.
+template <const char* tag>
+class BitmapRegistryOptions : public RegistryOptions<tag> {
+ public:
+  constexpr bool UseOccupancyBitmap() const { return true; }
+};
+
+char kHopScotchPlainTag[] = "registry_test_hopscotch_plain";
+char kHopScotchBitmapTag[] = "registry_test_hopscotch_bitmap";
+
+// The bitmap lives in the unused inlined buckets while it fits there, and at
+// the end of the bucket allocation after that.
+TEST(HopScotchHashMapTest, BitmapStorage) {
+  using PlainMap =
+      HopScotchHashMap<int64_t, int64_t, 4, std::hash<int64_t>,
+                       std::equal_to<int64_t>, size_t,
+                       RegistryOptions<kHopScotchPlainTag>>;
+  using BitmapMap =
+      HopScotchHashMap<int64_t, int64_t, 4, std::hash<int64_t>,
+                       std::equal_to<int64_t>, size_t,
+                       BitmapRegistryOptions<kHopScotchBitmapTag>>;
+  HashTableRegistry* registry = HashTableRegistry::Get();
+  PlainMap plain;
+  BitmapMap bitmap;
+  for (int64_t n : {100, 5000}) {
+    for (int64_t i = 0; i < n; ++i) {
+      plain[i] = i;
+      bitmap[i] = i;
+    }
+    auto usages = registry->Aggregate();
+    const HashTableRegistry::Usage& p = usages[kHopScotchPlainTag];
+    const HashTableRegistry::Usage& b = usages[kHopScotchBitmapTag];
+    ASSERT_EQ(p.capacity, b.capacity);
+    if (n == 100) {
+      EXPECT_EQ(p.outlined_bytes, b.outlined_bytes);
+    } else {
+      EXPECT_GT(b.outlined_bytes, p.outlined_bytes);
+      EXPECT_LE(b.outlined_bytes, p.outlined_bytes + b.capacity / 8 + 64);
+    }
+
+    BitmapMap copy(bitmap);
+    BitmapMap moved(std::move(copy));
+    BitmapMap assigned;
+    assigned[-1] = -1;
+    assigned = moved;
+    moved = std::move(assigned);
+    EXPECT_EQ(0, copy.size());
+    EXPECT_EQ(n, moved.size());
+    int64_t sum = 0;
+    for (const auto& elem : moved) sum += elem.second;
+    EXPECT_EQ(n * (n - 1) / 2, sum);
+    moved.clear();
+    EXPECT_EQ(0, moved.size());
+    EXPECT_TRUE(moved.begin() == moved.end());
+  }
+}
+
+// Options that sample every operation.
+class SampleOptions : public MapOptions<int> {
+ public:
+  constexpr uint32_t SampleEvery() const { return 1; }
+};
+
+// Returns the number of samples with "op" and "result".
+int CountSamples(const std::vector<HashTableSample>& samples,
+                 HashTableSample::Op op, HashTableSample::Result result) {
+  return std::count_if(samples.begin(), samples.end(),
+                       [op, result](const HashTableSample& s) {
+                         return s.op == op && s.result == result;
+                       });
+}
+
+template <typename Map>
+void TestSampling() {
+  std::vector<HashTableSample> samples;
+  HashTableSampler::Get()->Drain(&samples);
+  samples.clear();
+  {
+    Map m;
+    for (int i = 0; i < 100; ++i) m[i] = i;
+    m[0] = 1;
+    for (int i = 0; i < 200; ++i) m.find(i);
+    for (int i = 0; i < 200; i += 2) m.erase(i);
+  }
+  EXPECT_EQ(401, HashTableSampler::Get()->Drain(&samples));
+  using S = HashTableSample;
+  const int num_grows = CountSamples(samples, S::INSERT, S::GROW);
+  EXPECT_GT(num_grows, 0);
+  EXPECT_EQ(100, num_grows + CountSamples(samples, S::INSERT, S::MISS));
+  EXPECT_EQ(1, CountSamples(samples, S::INSERT, S::HIT));
+  EXPECT_EQ(100, CountSamples(samples, S::FIND, S::HIT));
+  EXPECT_EQ(100, CountSamples(samples, S::FIND, S::MISS));
+  EXPECT_EQ(50, CountSamples(samples, S::ERASE, S::HIT));
+  EXPECT_EQ(50, CountSamples(samples, S::ERASE, S::MISS));
+  for (const HashTableSample& s : samples) {
+    if (s.result == HashTableSample::HIT) {
+      EXPECT_GE(s.probe_length, 1);
+    }
+  }
+}
+
+TEST(InlinedHashMapTest, Sampling) {
+  TestSampling<InlinedHashMap<int, int, 4, SampleOptions>>();
+}
+
+TEST(HopScotchHashMapTest, Sampling) {
+  TestSampling<HopScotchHashMap<int, int, 4, std::hash<int>,
+                                std::equal_to<int>, size_t, SampleOptions>>();
+}
+
+// A sampled operation hashes the key only once, like an unsampled one.
+template <typename Map>
+void TestSamplingHashesOnce() {
+  Map m(1000);
+  CountingHash::num_calls = 0;
+  for (int i = 0; i < 100; ++i) m[i] = i;
+  EXPECT_EQ(100, CountingHash::num_calls);
+  CountingHash::num_calls = 0;
+  for (int i = 0; i < 100; ++i) m.find(i);
+  EXPECT_EQ(100, CountingHash::num_calls);
+  CountingHash::num_calls = 0;
+  for (int i = 0; i < 100; ++i) m.erase(i);
+  EXPECT_EQ(100, CountingHash::num_calls);
+}
+
+TEST(InlinedHashMapTest, SamplingHashesOnce) {
+  TestSamplingHashesOnce<
+      InlinedHashMap<int, int, 4, SampleOptions, CountingHash>>();
+}
+
+TEST(HopScotchHashMapTest, SamplingHashesOnce) {
+  TestSamplingHashesOnce<HopScotchHashMap<int, int, 4, CountingHash,
+                                          std::equal_to<int>, size_t,
+                                          SampleOptions>>();
+}
+
+TEST(HashTableSamplerTest, RingDropsWhenFull) {
+  std::vector<HashTableSample> samples;
+  HashTableSampler* sampler = HashTableSampler::Get();
+  sampler->Drain(&samples);
+  const uint64_t num_dropped = sampler->NumDropped();
+  std::thread([]() {
+    InlinedHashMap<int, int, 4, SampleOptions> m;
+    for (size_t i = 0; i < HashTableSampleRing::kCapacity + 10; ++i) {
+      m.find(i);
+    }
+  }).join();
+  samples.clear();
+  EXPECT_EQ(HashTableSampleRing::kCapacity, sampler->Drain(&samples));
+  EXPECT_EQ(num_dropped + 10, sampler->NumDropped());
+}
+
+TYPED_TEST(MapTest, Stats) {
+  TypeParam t;
+  EXPECT_EQ(0, t.GetStats().size);
+  for (int i = 0; i < 100; ++i) t[std::to_string(i)] = "v";
+  for (int i = 0; i < 100; i += 2) t.erase(std::to_string(i));
+  const auto stats = t.GetStats();
+  EXPECT_EQ(50, stats.size);
+  EXPECT_EQ(t.capacity(), stats.capacity);
+  EXPECT_DOUBLE_EQ(50.0 / t.capacity(), stats.load_factor);
+}
+
+TEST(CopyTest, TriviallyCopyable) {
+  static_assert(std::is_trivially_copyable<
+                    HopScotchHashMap<int, int, 8>::Table::Bucket>::value,
+                "Buckets of trivial values must be trivially copyable");
+  static_assert(!std::is_trivially_copyable<HopScotchHashMap<
+                    std::string, std::string, 8>::Table::Bucket>::value,
+                "Buckets of strings must not be trivially copyable");
+  TestCopyTriviallyCopyable<InlinedHashMap<int, int, 8, MapOptions<int>>>();
+  TestCopyTriviallyCopyable<HopScotchHashMap<int, int, 8>>();
+  // No inlined slots and no metadata.
+  TestCopyTriviallyCopyable<InlinedHashMap<int, int, 0, MapOptions<int>>>();
+  TestCopyTriviallyCopyable<HopScotchHashMap<int, int, 0>>();
+}
+
 TYPED_TEST(MapTest, Simple) {
   TypeParam map;
   EXPECT_EQ(8, map.capacity());
@@ -132,6 +1582,30 @@ TYPED_TEST(MapTest, Clear) {
   EXPECT_TRUE(map.find("h1") == map.end());
 }
 
+TYPED_TEST(MapTest, ClearAndReuse) {
+  TypeParam t;
+  for (int i = 0; i < 1000; ++i) {
+    t[std::to_string(i)] = "v";
+  }
+  t.clear();
+  EXPECT_TRUE(t.begin() == t.end());
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 10; ++i) {
+      t[std::to_string(i * 97 + round)] = std::to_string(i);
+    }
+    t.erase(std::to_string(round));
+    std::unordered_set<std::string> keys;
+    for (const auto& e : t) keys.insert(e.first);
+    EXPECT_EQ(9, keys.size());
+    EXPECT_EQ(9, t.size());
+    EXPECT_EQ(0, keys.count(std::to_string(round)));
+    EXPECT_EQ(1, keys.count(std::to_string(97 + round)));
+    t.clear();
+    EXPECT_TRUE(t.empty());
+    EXPECT_TRUE(t.begin() == t.end());
+  }
+}
+
 TYPED_TEST(MapTest, Iterators) {
   TypeParam t;
   t["h0"] = "w0";
@@ -310,60 +1784,450 @@ std::vector<int> TestValues<int>(int num_values) {
   for (int i = 0; i < num_values; ++i) {
     values.push_back(dist(rand));
   }
-  return values;
+  return values;
+}
+
+// Insert state.range(0) keys into a new map.
+//
+// Also reports the memory used by the map, including the map object itself
+// and the heap-allocated keys: bytes per element, the number of allocations,
+// and the peak bytes, which include the moment during rehashing when the old
+// and the new arrays coexist.
+template <typename Key, typename NewMapCallback>
+void DoInsertTest(benchmark::State& state, NewMapCallback cb) {
+  std::vector<Key> values = TestValues<Key>(state.range(0));
+  int64_t num_elements = 0;
+  int64_t bytes = 0;
+  int64_t peak_bytes = 0;
+  int64_t allocations = 0;
+  PerfCounters perf;
+  while (state.KeepRunning()) {
+    AllocationTracker tracker;
+    auto map = cb();
+    int n = 0;
+    for (const Key& v : values) {
+      Callback((*map)[v]) = n++;
+    }
+    state.PauseTiming();
+    perf.Pause();
+    num_elements = map->size();
+    bytes = tracker.LiveBytes();
+    peak_bytes = tracker.PeakBytes();
+    allocations = tracker.NumAllocations();
+    map.reset();
+    perf.Resume();
+    state.ResumeTiming();
+  }
+  perf.Report(state, state.iterations() * values.size());
+  state.counters["bytes_per_elem"] =
+      static_cast<double>(bytes) / std::max<int64_t>(num_elements, 1);
+  state.counters["peak_bytes"] = peak_bytes;
+  state.counters["allocs"] = allocations;
+}
+
+template <typename Key, typename Map>
+void DoLookupTest(benchmark::State& state, std::unique_ptr<Map> map) {
+  std::vector<Key> values = TestValues<Key>(state.range(0));
+  int n = 0;
+  for (const Key& v : values) {
+    (*map)[v] = n++;
+  }
+
+  PerfCounters perf;
+  while (state.KeepRunning()) {
+    for (const Key& v : values) {
+      auto it = map->find(v);
+      if (it == map->end()) abort();
+      Callback(it->second);
+    }
+  }
+  perf.Report(state, state.iterations() * values.size());
+}
+
+template <typename Key, typename Map>
+void DoCopyTest(benchmark::State& state, std::unique_ptr<Map> map) {
+  std::vector<Key> values = TestValues<Key>(state.range(0));
+  int n = 0;
+  for (const Key& v : values) {
+    (*map)[v] = n++;
+  }
+
+  while (state.KeepRunning()) {
+    Map copy(*map);
+    Callback(copy);
+  }
+  state.SetItemsProcessed(state.iterations() * map->size());
+}
+
+int kMinValues = 4;
+int kMaxValues = 1024 * 1024;
+
+// Returns "num_values" distinct test values.
+template <typename T>
+std::vector<T> UniqueTestValues(int num_values) {
+  std::vector<T> values;
+  std::unordered_set<T> seen;
+  for (int n = num_values; values.size() < static_cast<size_t>(num_values);
+       n *= 2) {
+    values.clear();
+    seen.clear();
+    for (T& v : TestValues<T>(n)) {
+      if (values.size() == static_cast<size_t>(num_values)) break;
+      if (seen.insert(v).second) values.push_back(std::move(v));
+    }
+  }
+  return values;
+}
+
+// Prepare a newly created map for the benchmarks.
+template <typename Map>
+void InitMap(Map*) {}
+
+template <typename Value>
+void InitMap(google::dense_hash_map<int, Value>* map) {
+  map->set_empty_key(-1);
+  map->set_deleted_key(-2);
+}
+
+template <typename Value>
+void InitMap(google::dense_hash_map<std::string, Value>* map) {
+  map->set_empty_key("");
+  map->set_deleted_key("d");
+}
+
+// The map types that the benchmarks compare.
+template <typename Key, typename Value = int64_t>
+using InlinedBenchmarkMap = InlinedHashMap<Key, Value, 0, MapOptions<Key>>;
+template <typename Key, typename Value = int64_t>
+using HopScotchBenchmarkMap = HopScotchHashMap<Key, Value, 0>;
+template <typename Key, typename Value = int64_t>
+using UnorderedBenchmarkMap = std::unordered_map<Key, Value>;
+template <typename Key, typename Value = int64_t>
+using DenseBenchmarkMap = google::dense_hash_map<Key, Value>;
+
+// Returns a new, empty map of type Map.
+template <typename Map>
+std::unique_ptr<Map> NewBenchmarkMap() {
+  std::unique_ptr<Map> map(new Map);
+  InitMap(map.get());
+  return map;
+}
+
+// Number of maps that DoTinyMapsTest keeps alive at a time.
+constexpr int kNumTinyMaps = 4096;
+
+// Create kNumTinyMaps maps of type Map, insert state.range(0) keys into each,
+// look up every key plus as many absent keys, and destroy the maps. This is
+// the per-request usage pattern that NumInlinedElements is designed for.
+//
+// Reports the memory held per map, and the number of allocations per map.
+template <typename Map>
+void DoTinyMapsTest(benchmark::State& state) {
+  const int num_values = state.range(0);
+  std::vector<int> values = UniqueTestValues<int>(kNumTinyMaps + num_values);
+  int64_t bytes = 0;
+  int64_t allocations = 0;
+  while (state.KeepRunning()) {
+    AllocationTracker tracker;
+    std::vector<Map> maps(kNumTinyMaps);
+    for (int i = 0; i < kNumTinyMaps; ++i) {
+      Map* map = &maps[i];
+      InitMap(map);
+      // Each map gets a different, overlapping window of the values, and
+      // the value just past the window is absent.
+      for (int j = 0; j < num_values; ++j) {
+        Callback((*map)[values[i + j]]) = j;
+      }
+      for (int j = 0; j <= num_values; ++j) {
+        auto it = map->find(values[i + j]);
+        if ((it != map->end()) != (j < num_values)) abort();
+      }
+    }
+    state.PauseTiming();
+    bytes = tracker.LiveBytes();
+    allocations = tracker.NumAllocations();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * kNumTinyMaps);
+  state.counters["bytes_per_map"] =
+      static_cast<double>(bytes) / kNumTinyMaps;
+  state.counters["allocs_per_map"] =
+      static_cast<double>(allocations) / kNumTinyMaps;
+}
+
+// Returns the number of buckets in "map".
+template <typename Map>
+auto MapCapacity(const Map& map) -> decltype(map.capacity()) {
+  return map.capacity();
+}
+template <typename Map>
+auto MapCapacity(const Map& map) -> decltype(map.bucket_count()) {
+  return map.bucket_count();
+}
+
+// Run a random mix of find, insert, and erase against a map that holds
+// state.range(0) elements on average. state.range(1) is the percentage of
+// finds. The rest is split evenly between inserts of absent keys and erases of
+// present keys, so the size stays roughly constant while tombstones pile up.
+//
+// Reports the capacity at the start and the end, the max capacity, and the
+// number of times the capacity changed.
+template <typename Map>
+void BM_Mixed(benchmark::State& state) {
+  using Key = typename Map::key_type;
+  auto map = NewBenchmarkMap<Map>();
+  const int num_values = state.range(0);
+  const int find_percent = state.range(1);
+  const int insert_percent = find_percent + (100 - find_percent) / 2;
+  // live[0, num_live) are in the map. The rest are not.
+  std::vector<Key> live = UniqueTestValues<Key>(num_values * 2);
+  int num_live = num_values;
+  for (int i = 0; i < num_live; ++i) {
+    (*map)[live[i]] = i;
+  }
+
+  std::mt19937 rand(0);
+  const size_t initial_capacity = MapCapacity(*map);
+  size_t max_capacity = initial_capacity;
+  size_t last_capacity = initial_capacity;
+  int64_t num_resizes = 0;
+  PerfCounters perf;
+  while (state.KeepRunning()) {
+    for (int i = 0; i < num_values; ++i) {
+      const uint32_t r = rand();
+      const int op = r % 100;
+      if (op < find_percent) {
+        auto it = map->find(live[(r >> 8) % num_live]);
+        if (it == map->end()) abort();
+        Callback(it->second);
+      } else if (op < insert_percent) {
+        if (num_live == static_cast<int>(live.size())) continue;
+        const int j = num_live + (r >> 8) % (live.size() - num_live);
+        std::swap(live[num_live], live[j]);
+        Callback((*map)[live[num_live]]) = i;
+        ++num_live;
+      } else {
+        if (num_live == 0) continue;
+        const int j = (r >> 8) % num_live;
+        --num_live;
+        std::swap(live[num_live], live[j]);
+        if (map->erase(live[num_live]) != 1) abort();
+      }
+    }
+    const size_t capacity = MapCapacity(*map);
+    if (capacity != last_capacity) {
+      ++num_resizes;
+      last_capacity = capacity;
+      max_capacity = std::max(max_capacity, capacity);
+    }
+  }
+  perf.Report(state, state.iterations() * num_values);
+  state.SetItemsProcessed(state.iterations() * num_values);
+  state.counters["initial_capacity"] = initial_capacity;
+  state.counters["final_capacity"] = last_capacity;
+  state.counters["max_capacity"] = max_capacity;
+  state.counters["resizes"] = num_resizes;
+}
+
+// Returns the sizes that Range(kMinValues, kMaxValues) generates.
+std::vector<int> BenchmarkSizes() {
+  std::vector<int> sizes = {kMinValues};
+  for (int n = 8; n < kMaxValues; n *= 8) {
+    if (n > kMinValues) sizes.push_back(n);
+  }
+  sizes.push_back(kMaxValues);
+  return sizes;
+}
+
+// Argument pairs for BM_Mixed: {# of elements, % of finds}.
+void MixedTestArgs(benchmark::internal::Benchmark* b) {
+  for (int find_percent : {90, 50, 0}) {
+    for (int n : BenchmarkSizes()) {
+      b->Args({n, find_percent});
+    }
+  }
+}
+
+// Look up state.range(0) keys in a map with state.range(0) elements.
+// state.range(1) is the percentage of the keys that are absent.
+template <typename Key, typename Map>
+void DoLookupMissTest(benchmark::State& state, std::unique_ptr<Map> map) {
+  const int num_values = state.range(0);
+  const int miss_percent = state.range(1);
+  std::vector<Key> values = UniqueTestValues<Key>(num_values * 2);
+  for (int i = 0; i < num_values; ++i) {
+    (*map)[values[i]] = i;
+  }
+  // Replace miss_percent% of the first half with absent keys.
+  std::mt19937 rand(0);
+  for (int i = 0; i < num_values; ++i) {
+    if (static_cast<int>(rand() % 100) < miss_percent) {
+      std::swap(values[i], values[num_values + i]);
+    }
+  }
+  values.resize(num_values);
+  std::shuffle(values.begin(), values.end(), rand);
+
+  int64_t num_hits = 0;
+  PerfCounters perf;
+  while (state.KeepRunning()) {
+    for (const Key& v : values) {
+      auto it = map->find(v);
+      if (it != map->end()) {
+        Callback(it->second);
+        ++num_hits;
+      }
+    }
+  }
+  perf.Report(state, state.iterations() * num_values);
+  state.SetItemsProcessed(state.iterations() * num_values);
+  state.counters["hit_ratio"] =
+      static_cast<double>(num_hits) / (state.iterations() * num_values);
+}
+
+// Argument pairs for DoLookupMissTest: {# of elements, % of misses}.
+void LookupMissTestArgs(benchmark::internal::Benchmark* b) {
+  for (int miss_percent : {0, 50, 90, 100}) {
+    for (int n : BenchmarkSizes()) {
+      b->Args({n, miss_percent});
+    }
+  }
 }
 
-template <typename Key, typename NewMapCallback>
-void DoInsertTest(benchmark::State& state, NewMapCallback cb) {
-  std::vector<Key> values = TestValues<Key>(state.range(0));
-  while (state.KeepRunning()) {
-    auto map = cb();
-    int n = 0;
-    for (const Key& v : values) {
-      Callback((*map)[v]) = n++;
+// Distribution of the keys accessed by the skewed benchmarks.
+enum class KeyDistribution {
+  // Key i is accessed with probability proportional to 1/(i+1)^s.
+  kZipfian,
+  // A hot set of 1% of the keys receives most of the accesses. The rest are
+  // spread uniformly over the other keys.
+  kHotSet,
+};
+
+// Returns "num_accesses" indices in [0, num_values) drawn from
+// "distribution". For kZipfian, "skew" is the exponent s times 100. For
+// kHotSet, "skew" is the percentage of accesses that go to the hot set.
+std::vector<int> SkewedIndices(KeyDistribution distribution, int num_values,
+                               int skew, int num_accesses) {
+  std::mt19937 rand(0);
+  std::vector<int> indices;
+  indices.reserve(num_accesses);
+  if (distribution == KeyDistribution::kZipfian) {
+    std::vector<double> cdf(num_values);
+    double sum = 0;
+    for (int i = 0; i < num_values; ++i) {
+      sum += std::pow(i + 1, -skew / 100.0);
+      cdf[i] = sum;
+    }
+    std::uniform_real_distribution<double> dist(0, sum);
+    for (int i = 0; i < num_accesses; ++i) {
+      const auto it = std::lower_bound(cdf.begin(), cdf.end(), dist(rand));
+      indices.push_back(std::min<int>(it - cdf.begin(), num_values - 1));
+    }
+  } else {
+    const int num_hot = std::max(1, num_values / 100);
+    std::uniform_int_distribution<int> percent_dist(0, 99);
+    std::uniform_int_distribution<int> hot_dist(0, num_hot - 1);
+    std::uniform_int_distribution<int> cold_dist(
+        std::min(num_hot, num_values - 1), num_values - 1);
+    for (int i = 0; i < num_accesses; ++i) {
+      indices.push_back(percent_dist(rand) < skew ? hot_dist(rand)
+                                                  : cold_dist(rand));
     }
-    state.PauseTiming();
-    map.reset();
-    state.ResumeTiming();
   }
+  return indices;
 }
 
-template <typename Key, typename Map>
-void DoLookupTest(benchmark::State& state, std::unique_ptr<Map> map) {
-  std::vector<Key> values = TestValues<Key>(state.range(0));
+// Look up state.range(0) keys drawn from "distribution" with skew
+// state.range(1), in a map that contains all state.range(0) keys.
+template <typename Map>
+void DoSkewedLookupTest(benchmark::State& state, KeyDistribution distribution) {
+  using Key = typename Map::key_type;
+  auto map = NewBenchmarkMap<Map>();
+  const int num_values = state.range(0);
+  // The values are in random order, so the hot keys are scattered over the
+  // table.
+  std::vector<Key> values = UniqueTestValues<Key>(num_values);
   int n = 0;
   for (const Key& v : values) {
     (*map)[v] = n++;
   }
+  const std::vector<int> indices =
+      SkewedIndices(distribution, num_values, state.range(1), num_values);
 
+  PerfCounters perf;
   while (state.KeepRunning()) {
-    for (const Key& v : values) {
-      auto it = map->find(v);
+    for (int i : indices) {
+      auto it = map->find(values[i]);
       if (it == map->end()) abort();
       Callback(it->second);
     }
   }
+  perf.Report(state, state.iterations() * num_values);
+  state.SetItemsProcessed(state.iterations() * num_values);
 }
 
-#if 0
-template <typename Key, typename Map>
-void DoDeleteTest(benchmark::State& state, std::unique_ptr<Map> map) {
-  std::vector<Key> values0 = TestValues<Key>(state.range(0) / 2);
-  std::vector<Key> values1 = TestValues<Key>(state.range(0) / 2);
+// Insert or update state.range(0) keys drawn from "distribution" with skew
+// state.range(1). Repeated keys update the existing element.
+template <typename Map>
+void DoSkewedInsertTest(benchmark::State& state, KeyDistribution distribution) {
+  using Key = typename Map::key_type;
+  const int num_values = state.range(0);
+  std::vector<Key> values = UniqueTestValues<Key>(num_values);
+  const std::vector<int> indices =
+      SkewedIndices(distribution, num_values, state.range(1), num_values);
+  size_t num_distinct = 0;
   while (state.KeepRunning()) {
-    int n = 0;
-    for (const Key& v : values) {
-      (*map)[v] = n++;
+    auto map = NewBenchmarkMap<Map>();
+    for (int i : indices) {
+      ++Callback((*map)[values[i]]);
     }
-    for (const Key& v : values) {
-      Callback((*map)[v]);
+    state.PauseTiming();
+    num_distinct = map->size();
+    map.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * num_values);
+  state.counters["distinct_keys"] = num_distinct;
+}
+
+template <typename Map>
+void BM_ZipfianLookup(benchmark::State& state) {
+  DoSkewedLookupTest<Map>(state, KeyDistribution::kZipfian);
+}
+
+template <typename Map>
+void BM_ZipfianInsert(benchmark::State& state) {
+  DoSkewedInsertTest<Map>(state, KeyDistribution::kZipfian);
+}
+
+template <typename Map>
+void BM_HotSetLookup(benchmark::State& state) {
+  DoSkewedLookupTest<Map>(state, KeyDistribution::kHotSet);
+}
+
+template <typename Map>
+void BM_HotSetInsert(benchmark::State& state) {
+  DoSkewedInsertTest<Map>(state, KeyDistribution::kHotSet);
+}
+
+// Argument pairs for the Zipfian benchmarks: {# of keys, s * 100}.
+void ZipfianTestArgs(benchmark::internal::Benchmark* b) {
+  for (int skew : {99, 120}) {
+    for (int n : BenchmarkSizes()) {
+      b->Args({n, skew});
     }
   }
 }
-#endif
 
-int kMinValues = 4;
-int kMaxValues = 1024 * 1024;
+// Argument pairs for the hot-set benchmarks: {# of keys, % of accesses to the
+// hot set}.
+void HotSetTestArgs(benchmark::internal::Benchmark* b) {
+  for (int skew : {90, 99}) {
+    for (int n : BenchmarkSizes()) {
+      b->Args({n, skew});
+    }
+  }
+}
 
 template <typename Key>
 std::unique_ptr<HopScotchHashMap<Key, int64_t, 0>> NewHopScotchHashMap() {
@@ -378,6 +2242,14 @@ NewInlinedHashMap() {
       new InlinedHashMap<Key, int64_t, 0, MapOptions<Key>>);
 }
 
+template <typename Key>
+std::unique_ptr<InlinedHashMap<Key, int64_t, 0, OverflowMapOptions<Key>>>
+NewInlinedHashMapWithOverflowBits() {
+  return std::unique_ptr<
+      InlinedHashMap<Key, int64_t, 0, OverflowMapOptions<Key>>>(
+      new InlinedHashMap<Key, int64_t, 0, OverflowMapOptions<Key>>);
+}
+
 template <typename Key>
 std::unique_ptr<std::unordered_map<Key, int64_t>> NewUnorderedMap() {
   return std::unique_ptr<std::unordered_map<Key, int64_t>>(
@@ -400,6 +2272,463 @@ std::unique_ptr<google::dense_hash_map<Key, int64_t>> NewDenseHashMap() {
   return map;
 }
 
+// Options whose max load factor is set at run time.
+class LoadFactorOptions : public MapOptions<int> {
+ public:
+  explicit LoadFactorOptions(double max_load_factor = 0.5)
+      : max_load_factor_(max_load_factor) {}
+  double MaxLoadFactor() const { return max_load_factor_; }
+
+ private:
+  double max_load_factor_;
+};
+
+using LoadFactorMap = InlinedHashMap<int, int64_t, 0, LoadFactorOptions>;
+
+// Operation measured by DoLoadFactorTest.
+enum class LoadFactorOp { kHit, kMiss, kInsert };
+
+// Returns the number of elements in a map that holds at least "min_size" of
+// "values" and is as full as it gets, i.e., the next insertion expands the
+// table.
+template <typename NewMapCallback>
+int NumValuesBeforeExpansion(NewMapCallback new_map,
+                             const std::vector<int>& values, int min_size) {
+  auto map = new_map();
+  size_t capacity = MapCapacity(*map);
+  for (int i = 0; i < static_cast<int>(values.size()); ++i) {
+    (*map)[values[i]] = i;
+    if (MapCapacity(*map) != capacity && i >= min_size) return i;
+    capacity = MapCapacity(*map);
+  }
+  abort();
+}
+
+// Returns the average number of slots that a successful lookup visits.
+double AverageProbeLength(const LoadFactorMap& map) {
+  const auto& table = map.table();
+  int64_t total = 0;
+  for (size_t i = 0; i < table.Capacity(); ++i) {
+    if (!table.IsEmptySlot(i) && !table.IsTombstoneSlot(i)) {
+      total += table.ProbeLength(i);
+    }
+  }
+  return static_cast<double>(total) / std::max<size_t>(map.size(), 1);
+}
+// For HopScotchHashMap: the buckets from the home bucket to the element.
+template <typename Map>
+double AverageProbeLength(const Map& map) {
+  return map.GetStats().mean_hop_distance + 1;
+}
+
+// Fill a map created by "new_map" with at least "min_size" elements, up to
+// the point where the next insertion expands the table. Then measure "op":
+// lookups of the elements, lookups of as many absent keys, or filling a new
+// map to the same size.
+//
+// Reports the load factor of the filled map, the memory per element, and the
+// average number of slots that a successful lookup visits.
+template <typename NewMapCallback>
+void DoLoadFactorTest(benchmark::State& state, NewMapCallback new_map,
+                      int min_size, LoadFactorOp op) {
+  std::vector<int> values = UniqueTestValues<int>(min_size * 16);
+  const int num_values = NumValuesBeforeExpansion(new_map, values, min_size);
+  std::vector<int> absent(values.end() - num_values, values.end());
+  values.resize(num_values);
+
+  AllocationTracker tracker;
+  auto map = new_map();
+  for (int i = 0; i < num_values; ++i) {
+    (*map)[values[i]] = i;
+  }
+  const int64_t bytes = tracker.LiveBytes();
+  std::shuffle(values.begin(), values.end(), std::mt19937(0));
+
+  while (state.KeepRunning()) {
+    switch (op) {
+      case LoadFactorOp::kHit:
+        for (int v : values) {
+          auto it = map->find(v);
+          if (it == map->end()) abort();
+          Callback(it->second);
+        }
+        break;
+      case LoadFactorOp::kMiss:
+        for (int v : absent) {
+          if (map->find(v) != map->end()) abort();
+        }
+        break;
+      case LoadFactorOp::kInsert: {
+        auto other = new_map();
+        for (int v : values) {
+          Callback((*other)[v]) = v;
+        }
+        break;
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * num_values);
+  state.counters["load_factor"] =
+      static_cast<double>(map->size()) / MapCapacity(*map);
+  state.counters["bytes_per_elem"] = static_cast<double>(bytes) / num_values;
+  state.counters["probe_length"] = AverageProbeLength(*map);
+}
+
+void DoInlinedLoadFactorTest(benchmark::State& state, LoadFactorOp op) {
+  const double max_load_factor = state.range(0) / 100.0;
+  DoLoadFactorTest(state,
+                   [max_load_factor]() {
+                     return std::unique_ptr<LoadFactorMap>(new LoadFactorMap(
+                         0, LoadFactorOptions(max_load_factor)));
+                   },
+                   state.range(1), op);
+}
+
+void DoHopScotchLoadFactorTest(benchmark::State& state, LoadFactorOp op) {
+  DoLoadFactorTest(state, []() { return NewHopScotchHashMap<int>(); },
+                   state.range(0), op);
+}
+
+// Argument pairs for the InlinedHashMap load-factor benchmarks: {max load
+// factor in percent, min # of elements}.
+void LoadFactorTestArgs(benchmark::internal::Benchmark* b) {
+  for (int n : {4096, 262144}) {
+    for (int percent : {30, 40, 50, 60, 70, 80, 90, 95}) {
+      b->Args({percent, n});
+    }
+  }
+}
+
+// Arguments for the HopScotchHashMap load-factor benchmarks: {min # of
+// elements}. The load factor is wherever the table stops before ExpandTable.
+void HopScotchLoadFactorTestArgs(benchmark::internal::Benchmark* b) {
+  for (int n : {4096, 262144}) {
+    b->Args({n});
+  }
+}
+
+// The benchmark maps, with the occupancy bitmap enabled.
+template <typename Key>
+using InlinedBitmapBenchmarkMap =
+    InlinedHashMap<Key, int64_t, 0, BitmapMapOptions<Key>>;
+template <typename Key>
+using HopScotchBitmapBenchmarkMap =
+    HopScotchHashMap<Key, int64_t, 0, std::hash<Key>, std::equal_to<Key>,
+                     size_t, BitmapMapOptions<Key>>;
+
+// Insert state.range(0) keys into the map, erase state.range(1) percent of
+// them, and then iterate over the map.
+//
+// Reports the fill ratio of the table, and the memory held by the map per
+// element, which bounds the number of bytes an iteration touches per element.
+template <typename Map>
+void BM_Iterate(benchmark::State& state) {
+  using Key = typename Map::key_type;
+  auto map = NewBenchmarkMap<Map>();
+  const int num_values = state.range(0);
+  const int erase_percent = state.range(1);
+  std::vector<Key> values = UniqueTestValues<Key>(num_values);
+  AllocationTracker tracker;
+  for (int i = 0; i < num_values; ++i) {
+    (*map)[values[i]] = i;
+  }
+  std::mt19937 rand(0);
+  for (const Key& v : values) {
+    if (static_cast<int>(rand() % 100) < erase_percent) map->erase(v);
+  }
+  const int64_t bytes = tracker.LiveBytes();
+
+  int64_t sum = 0;
+  while (state.KeepRunning()) {
+    for (const auto& elem : *map) {
+      sum += elem.second;
+    }
+  }
+  Callback(sum);
+  const size_t size = std::max<size_t>(map->size(), 1);
+  state.SetItemsProcessed(state.iterations() * map->size());
+  state.counters["fill"] = static_cast<double>(map->size()) / MapCapacity(*map);
+  state.counters["bytes_per_elem"] = static_cast<double>(bytes) / size;
+}
+
+// Argument pairs for BM_Iterate: {# of elements, % of elements erased}.
+void IterateTestArgs(benchmark::internal::Benchmark* b) {
+  for (int erase_percent : {0, 50, 90, 99}) {
+    for (int n : {64, 4096, 262144}) {
+      b->Args({n, erase_percent});
+    }
+  }
+}
+
+// Returns the index of the thread that runs "state". Older versions of the
+// benchmark library expose it as a member variable.
+template <typename State>
+auto ThreadIndex(const State& state) -> decltype(state.thread_index()) {
+  return state.thread_index();
+}
+template <typename State>
+auto ThreadIndex(const State& state) -> decltype(state.thread_index + 0) {
+  return state.thread_index;
+}
+
+// A mapped value that readers and a writer can access concurrently.
+struct SharedCounter {
+  SharedCounter() = default;
+  SharedCounter(const SharedCounter& other)
+      : value(other.value.load(std::memory_order_relaxed)) {}
+  SharedCounter& operator=(const SharedCounter& other) {
+    value.store(other.value.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    return *this;
+  }
+  std::atomic<int64_t> value{0};
+};
+
+// Look up state.range(0) keys from every thread in a map shared by all the
+// threads. If "with_writer", thread 0 instead overwrites the mapped values in
+// place, without changing the structure of the map.
+//
+// items_per_second is the aggregate throughput of all the threads, and
+// items_per_thread is the average throughput of one thread.
+template <typename Map>
+void DoSharedLookupTest(benchmark::State& state, bool with_writer) {
+  static Map* shared_map = nullptr;
+  std::vector<int> values = UniqueTestValues<int>(state.range(0));
+  const int thread_index = ThreadIndex(state);
+  if (thread_index == 0) {
+    shared_map = new Map;
+    for (size_t i = 0; i < values.size(); ++i) {
+      (*shared_map)[values[i]].value = i;
+    }
+  }
+  // Each thread looks up the keys in a different order.
+  std::shuffle(values.begin(), values.end(), std::mt19937(thread_index));
+
+  int64_t sum = 0;
+  while (state.KeepRunning()) {
+    if (with_writer && thread_index == 0) {
+      for (int v : values) {
+        auto it = shared_map->find(v);
+        if (it == shared_map->end()) abort();
+        it->second.value.store(v, std::memory_order_relaxed);
+      }
+    } else {
+      const Map& map = *shared_map;
+      for (int v : values) {
+        auto it = map.find(v);
+        if (it == map.end()) abort();
+        sum += it->second.value.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  Callback(sum);
+  state.SetItemsProcessed(state.iterations() * values.size());
+  state.counters["items_per_thread"] = benchmark::Counter(
+      state.iterations() * values.size(), benchmark::Counter::kAvgThreadsRate);
+  if (thread_index == 0) {
+    delete shared_map;
+    shared_map = nullptr;
+  }
+}
+
+// Arguments for DoSharedLookupTest: {# of elements}, run with 1 to 64
+// threads.
+void SharedLookupTestArgs(benchmark::internal::Benchmark* b) {
+  for (int n : {4096, 1048576}) {
+    b->Args({n});
+  }
+  b->Threads(1)->Threads(4)->Threads(16)->Threads(64)->UseRealTime();
+}
+
+// Operation timed by DoLatencyTest.
+enum class LatencyOp {
+  // Insert state.range(0) keys into a new map, including every rehash.
+  kInsert,
+  // Alternately erase a key from and insert an absent key into a map with
+  // state.range(0) elements.
+  kChurn,
+  // Look up the keys of a map with state.range(0) elements.
+  kLookup,
+};
+
+// Time every single "op" with ReadCycleCounter(), and report the 50th, 99th,
+// and 99.9th percentile and the max latency in nanoseconds. The mean time
+// hides the rare insert that rehashes the whole table; the tail shows it.
+template <typename Map>
+void DoLatencyTest(benchmark::State& state, LatencyOp op) {
+  using Key = typename Map::key_type;
+  const int num_values = state.range(0);
+  // values[0, num_live) are in the map. The rest are not.
+  std::vector<Key> values = UniqueTestValues<Key>(num_values * 2);
+  int num_live = num_values;
+  auto map = NewBenchmarkMap<Map>();
+  if (op != LatencyOp::kInsert) {
+    for (int i = 0; i < num_live; ++i) {
+      (*map)[values[i]] = i;
+    }
+  }
+  std::mt19937 rand(0);
+  LatencyHistogram histogram;
+  while (state.KeepRunning()) {
+    switch (op) {
+      case LatencyOp::kInsert:
+        for (int i = 0; i < num_values; ++i) {
+          const uint64_t start = ReadCycleCounter();
+          Callback((*map)[values[i]]) = i;
+          histogram.Record(ReadCycleCounter() - start);
+        }
+        state.PauseTiming();
+        map = NewBenchmarkMap<Map>();
+        state.ResumeTiming();
+        break;
+      case LatencyOp::kChurn:
+        for (int i = 0; i < num_values; i += 2) {
+          std::swap(values[rand() % num_live], values[num_live - 1]);
+          uint64_t start = ReadCycleCounter();
+          if (map->erase(values[num_live - 1]) != 1) abort();
+          histogram.Record(ReadCycleCounter() - start);
+          std::swap(values[num_live - 1],
+                    values[num_live + rand() % num_values]);
+          start = ReadCycleCounter();
+          Callback((*map)[values[num_live - 1]]) = i;
+          histogram.Record(ReadCycleCounter() - start);
+        }
+        break;
+      case LatencyOp::kLookup:
+        for (int i = 0; i < num_values; ++i) {
+          const uint64_t start = ReadCycleCounter();
+          auto it = map->find(values[i]);
+          const uint64_t end = ReadCycleCounter();
+          if (it == map->end()) abort();
+          Callback(it->second);
+          histogram.Record(end - start);
+        }
+        break;
+    }
+  }
+  state.SetItemsProcessed(histogram.TotalCount());
+  const double cycles_per_ns = CyclesPerNanosecond();
+  state.counters["p50_ns"] = histogram.Percentile(0.5) / cycles_per_ns;
+  state.counters["p99_ns"] = histogram.Percentile(0.99) / cycles_per_ns;
+  state.counters["p99.9_ns"] = histogram.Percentile(0.999) / cycles_per_ns;
+  state.counters["max_ns"] = histogram.Max() / cycles_per_ns;
+}
+
+template <typename Map>
+void BM_InsertLatency(benchmark::State& state) {
+  DoLatencyTest<Map>(state, LatencyOp::kInsert);
+}
+
+template <typename Map>
+void BM_ChurnLatency(benchmark::State& state) {
+  DoLatencyTest<Map>(state, LatencyOp::kChurn);
+}
+
+template <typename Map>
+void BM_LookupLatency(benchmark::State& state) {
+  DoLatencyTest<Map>(state, LatencyOp::kLookup);
+}
+
+// Arguments for the latency benchmarks: {# of elements}.
+void LatencyTestArgs(benchmark::internal::Benchmark* b) {
+  for (int n : {4096, 1048576}) {
+    b->Args({n});
+  }
+}
+
+// A value of N bytes.
+template <int N>
+struct Payload {
+  static_assert(N % sizeof(int64_t) == 0, "N");
+  int64_t data[N / sizeof(int64_t)];
+};
+
+template <int N>
+using InlinedPayloadMap = InlinedBenchmarkMap<int, Payload<N>>;
+template <int N>
+using HopScotchPayloadMap = HopScotchBenchmarkMap<int, Payload<N>>;
+template <int N>
+using UnorderedPayloadMap = UnorderedBenchmarkMap<int, Payload<N>>;
+template <int N>
+using DensePayloadMap = DenseBenchmarkMap<int, Payload<N>>;
+
+// Returns a new map of type Map that maps values[i] to a payload that starts
+// with i.
+template <typename Map>
+std::unique_ptr<Map> NewPayloadMap(const std::vector<int>& values) {
+  auto map = NewBenchmarkMap<Map>();
+  for (size_t i = 0; i < values.size(); ++i) {
+    (*map)[values[i]].data[0] = i;
+  }
+  return map;
+}
+
+// Insert state.range(0) keys into a new map.
+template <typename Map>
+void BM_PayloadInsert(benchmark::State& state) {
+  std::vector<int> values = UniqueTestValues<int>(state.range(0));
+  while (state.KeepRunning()) {
+    Callback(*NewPayloadMap<Map>(values));
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+// Look up every key in a map with state.range(0) elements.
+template <typename Map>
+void BM_PayloadLookup(benchmark::State& state) {
+  std::vector<int> values = UniqueTestValues<int>(state.range(0));
+  auto map = NewPayloadMap<Map>(values);
+  std::shuffle(values.begin(), values.end(), std::mt19937(0));
+  while (state.KeepRunning()) {
+    for (int v : values) {
+      auto it = map->find(v);
+      if (it == map->end()) abort();
+      Callback(it->second);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+// Erase every key from a map with state.range(0) elements.
+template <typename Map>
+void BM_PayloadErase(benchmark::State& state) {
+  std::vector<int> values = UniqueTestValues<int>(state.range(0));
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    auto map = NewPayloadMap<Map>(values);
+    state.ResumeTiming();
+    for (int v : values) {
+      if (map->erase(v) != 1) abort();
+    }
+    state.PauseTiming();
+    map.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+// Iterate over a map with state.range(0) elements.
+template <typename Map>
+void BM_PayloadIterate(benchmark::State& state) {
+  std::vector<int> values = UniqueTestValues<int>(state.range(0));
+  auto map = NewPayloadMap<Map>(values);
+  int64_t sum = 0;
+  while (state.KeepRunning()) {
+    for (const auto& elem : *map) {
+      sum += elem.second.data[0];
+    }
+  }
+  Callback(sum);
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+// Arguments for the payload benchmarks: {# of elements}.
+void PayloadTestArgs(benchmark::internal::Benchmark* b) {
+  for (int n : {4096, 131072}) {
+    b->Args({n});
+  }
+}
+
 void BM_Insert_HopScotchMap_Int(benchmark::State& state) {
   DoInsertTest<int>(state, []() { return NewHopScotchHashMap<int>(); });
 }
@@ -442,6 +2771,133 @@ void BM_Lookup_DenseHashMap_Int(benchmark::State& state) {
 
 BENCHMARK(BM_Lookup_DenseHashMap_Int)->Range(kMinValues, kMaxValues);
 
+void BM_Copy_HopScotchMap_Int(benchmark::State& state) {
+  DoCopyTest<int>(state, NewHopScotchHashMap<int>());
+}
+BENCHMARK(BM_Copy_HopScotchMap_Int)->Range(kMinValues, kMaxValues);
+
+void BM_Copy_InlinedMap_Int(benchmark::State& state) {
+  DoCopyTest<int>(state, NewInlinedHashMap<int>());
+}
+BENCHMARK(BM_Copy_InlinedMap_Int)->Range(kMinValues, kMaxValues);
+
+void BM_Copy_HopScotchMap_String(benchmark::State& state) {
+  DoCopyTest<std::string>(state, NewHopScotchHashMap<std::string>());
+}
+BENCHMARK(BM_Copy_HopScotchMap_String)->Range(kMinValues, kMaxValues);
+
+void BM_Copy_InlinedHashMap_String(benchmark::State& state) {
+  DoCopyTest<std::string>(state, NewInlinedHashMap<std::string>());
+}
+BENCHMARK(BM_Copy_InlinedHashMap_String)->Range(kMinValues, kMaxValues);
+
+BENCHMARK_TEMPLATE(BM_Mixed, HopScotchBenchmarkMap<int>)->Apply(MixedTestArgs);
+BENCHMARK_TEMPLATE(BM_Mixed, InlinedBenchmarkMap<int>)->Apply(MixedTestArgs);
+BENCHMARK_TEMPLATE(BM_Mixed, UnorderedBenchmarkMap<int>)->Apply(MixedTestArgs);
+BENCHMARK_TEMPLATE(BM_Mixed, DenseBenchmarkMap<int>)->Apply(MixedTestArgs);
+BENCHMARK_TEMPLATE(BM_Mixed, HopScotchBenchmarkMap<std::string>)
+    ->Apply(MixedTestArgs);
+BENCHMARK_TEMPLATE(BM_Mixed, InlinedBenchmarkMap<std::string>)
+    ->Apply(MixedTestArgs);
+BENCHMARK_TEMPLATE(BM_Mixed, UnorderedBenchmarkMap<std::string>)
+    ->Apply(MixedTestArgs);
+BENCHMARK_TEMPLATE(BM_Mixed, DenseBenchmarkMap<std::string>)
+    ->Apply(MixedTestArgs);
+
+void BM_LookupMiss_HopScotchMap_Int(benchmark::State& state) {
+  DoLookupMissTest<int>(state, NewHopScotchHashMap<int>());
+}
+BENCHMARK(BM_LookupMiss_HopScotchMap_Int)->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_InlinedMap_Int(benchmark::State& state) {
+  DoLookupMissTest<int>(state, NewInlinedHashMap<int>());
+}
+BENCHMARK(BM_LookupMiss_InlinedMap_Int)->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_InlinedMapWithOverflowBits_Int(benchmark::State& state) {
+  DoLookupMissTest<int>(state, NewInlinedHashMapWithOverflowBits<int>());
+}
+BENCHMARK(BM_LookupMiss_InlinedMapWithOverflowBits_Int)
+    ->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_UnorderedMap_Int(benchmark::State& state) {
+  DoLookupMissTest<int>(state, NewUnorderedMap<int>());
+}
+BENCHMARK(BM_LookupMiss_UnorderedMap_Int)->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_DenseHashMap_Int(benchmark::State& state) {
+  DoLookupMissTest<int>(state, NewDenseHashMap<int>());
+}
+BENCHMARK(BM_LookupMiss_DenseHashMap_Int)->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_HopScotchMap_String(benchmark::State& state) {
+  DoLookupMissTest<std::string>(state, NewHopScotchHashMap<std::string>());
+}
+BENCHMARK(BM_LookupMiss_HopScotchMap_String)->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_InlinedHashMap_String(benchmark::State& state) {
+  DoLookupMissTest<std::string>(state, NewInlinedHashMap<std::string>());
+}
+BENCHMARK(BM_LookupMiss_InlinedHashMap_String)->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_InlinedHashMapWithOverflowBits_String(
+    benchmark::State& state) {
+  DoLookupMissTest<std::string>(
+      state, NewInlinedHashMapWithOverflowBits<std::string>());
+}
+BENCHMARK(BM_LookupMiss_InlinedHashMapWithOverflowBits_String)
+    ->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_UnorderedMap_String(benchmark::State& state) {
+  DoLookupMissTest<std::string>(state, NewUnorderedMap<std::string>());
+}
+BENCHMARK(BM_LookupMiss_UnorderedMap_String)->Apply(LookupMissTestArgs);
+
+void BM_LookupMiss_DenseHashMap_String(benchmark::State& state) {
+  DoLookupMissTest<std::string>(state, NewDenseHashMap<std::string>());
+}
+BENCHMARK(BM_LookupMiss_DenseHashMap_String)->Apply(LookupMissTestArgs);
+
+void BM_TinyMaps_InlinedMap4_Int(benchmark::State& state) {
+  DoTinyMapsTest<InlinedHashMap<int, int64_t, 4, MapOptions<int>>>(state);
+}
+BENCHMARK(BM_TinyMaps_InlinedMap4_Int)->RangeMultiplier(2)->Range(1, 16);
+
+void BM_TinyMaps_InlinedMap8_Int(benchmark::State& state) {
+  DoTinyMapsTest<InlinedHashMap<int, int64_t, 8, MapOptions<int>>>(state);
+}
+BENCHMARK(BM_TinyMaps_InlinedMap8_Int)->RangeMultiplier(2)->Range(1, 16);
+
+void BM_TinyMaps_InlinedMap16_Int(benchmark::State& state) {
+  DoTinyMapsTest<InlinedHashMap<int, int64_t, 16, MapOptions<int>>>(state);
+}
+BENCHMARK(BM_TinyMaps_InlinedMap16_Int)->RangeMultiplier(2)->Range(1, 16);
+
+void BM_TinyMaps_HopScotchMap4_Int(benchmark::State& state) {
+  DoTinyMapsTest<HopScotchHashMap<int, int64_t, 4>>(state);
+}
+BENCHMARK(BM_TinyMaps_HopScotchMap4_Int)->RangeMultiplier(2)->Range(1, 16);
+
+void BM_TinyMaps_HopScotchMap8_Int(benchmark::State& state) {
+  DoTinyMapsTest<HopScotchHashMap<int, int64_t, 8>>(state);
+}
+BENCHMARK(BM_TinyMaps_HopScotchMap8_Int)->RangeMultiplier(2)->Range(1, 16);
+
+void BM_TinyMaps_HopScotchMap16_Int(benchmark::State& state) {
+  DoTinyMapsTest<HopScotchHashMap<int, int64_t, 16>>(state);
+}
+BENCHMARK(BM_TinyMaps_HopScotchMap16_Int)->RangeMultiplier(2)->Range(1, 16);
+
+void BM_TinyMaps_UnorderedMap_Int(benchmark::State& state) {
+  DoTinyMapsTest<std::unordered_map<int, int64_t>>(state);
+}
+BENCHMARK(BM_TinyMaps_UnorderedMap_Int)->RangeMultiplier(2)->Range(1, 16);
+
+void BM_TinyMaps_DenseHashMap_Int(benchmark::State& state) {
+  DoTinyMapsTest<google::dense_hash_map<int, int64_t>>(state);
+}
+BENCHMARK(BM_TinyMaps_DenseHashMap_Int)->RangeMultiplier(2)->Range(1, 16);
+
 void BM_Insert_HopScotchMap_String(benchmark::State& state) {
   DoInsertTest<std::string>(
       state, []() { return NewHopScotchHashMap<std::string>(); });
@@ -491,6 +2947,338 @@ void BM_Lookup_DenseHashMap_String(benchmark::State& state) {
 
 BENCHMARK(BM_Lookup_DenseHashMap_String)->Range(kMinValues, kMaxValues);
 
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, HopScotchBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, InlinedBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, UnorderedBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, DenseBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, HopScotchBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, InlinedBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, UnorderedBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, DenseBenchmarkMap<int>)
+    ->Apply(ZipfianTestArgs);
+
+BENCHMARK_TEMPLATE(BM_HotSetLookup, HopScotchBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetLookup, InlinedBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetLookup, UnorderedBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetLookup, DenseBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+
+BENCHMARK_TEMPLATE(BM_HotSetInsert, HopScotchBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetInsert, InlinedBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetInsert, UnorderedBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetInsert, DenseBenchmarkMap<int>)
+    ->Apply(HotSetTestArgs);
+
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, HopScotchBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, InlinedBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, UnorderedBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianLookup, DenseBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, HopScotchBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, InlinedBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, UnorderedBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+BENCHMARK_TEMPLATE(BM_ZipfianInsert, DenseBenchmarkMap<std::string>)
+    ->Apply(ZipfianTestArgs);
+
+BENCHMARK_TEMPLATE(BM_HotSetLookup, HopScotchBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetLookup, InlinedBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetLookup, UnorderedBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetLookup, DenseBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+
+BENCHMARK_TEMPLATE(BM_HotSetInsert, HopScotchBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetInsert, InlinedBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetInsert, UnorderedBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+BENCHMARK_TEMPLATE(BM_HotSetInsert, DenseBenchmarkMap<std::string>)
+    ->Apply(HotSetTestArgs);
+
+void BM_LoadFactorHit_InlinedMap_Int(benchmark::State& state) {
+  DoInlinedLoadFactorTest(state, LoadFactorOp::kHit);
+}
+BENCHMARK(BM_LoadFactorHit_InlinedMap_Int)->Apply(LoadFactorTestArgs);
+
+void BM_LoadFactorMiss_InlinedMap_Int(benchmark::State& state) {
+  DoInlinedLoadFactorTest(state, LoadFactorOp::kMiss);
+}
+BENCHMARK(BM_LoadFactorMiss_InlinedMap_Int)->Apply(LoadFactorTestArgs);
+
+void BM_LoadFactorInsert_InlinedMap_Int(benchmark::State& state) {
+  DoInlinedLoadFactorTest(state, LoadFactorOp::kInsert);
+}
+BENCHMARK(BM_LoadFactorInsert_InlinedMap_Int)->Apply(LoadFactorTestArgs);
+
+void BM_LoadFactorHit_HopScotchMap_Int(benchmark::State& state) {
+  DoHopScotchLoadFactorTest(state, LoadFactorOp::kHit);
+}
+BENCHMARK(BM_LoadFactorHit_HopScotchMap_Int)
+    ->Apply(HopScotchLoadFactorTestArgs);
+
+void BM_LoadFactorMiss_HopScotchMap_Int(benchmark::State& state) {
+  DoHopScotchLoadFactorTest(state, LoadFactorOp::kMiss);
+}
+BENCHMARK(BM_LoadFactorMiss_HopScotchMap_Int)
+    ->Apply(HopScotchLoadFactorTestArgs);
+
+void BM_LoadFactorInsert_HopScotchMap_Int(benchmark::State& state) {
+  DoHopScotchLoadFactorTest(state, LoadFactorOp::kInsert);
+}
+BENCHMARK(BM_LoadFactorInsert_HopScotchMap_Int)
+    ->Apply(HopScotchLoadFactorTestArgs);
+
+BENCHMARK_TEMPLATE(BM_PayloadInsert, InlinedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, InlinedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, InlinedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, InlinedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, InlinedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, HopScotchPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, HopScotchPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, HopScotchPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, HopScotchPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, HopScotchPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, UnorderedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, UnorderedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, UnorderedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, UnorderedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, UnorderedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, DensePayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, DensePayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, DensePayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, DensePayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadInsert, DensePayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+
+BENCHMARK_TEMPLATE(BM_PayloadLookup, InlinedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, InlinedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, InlinedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, InlinedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, InlinedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, HopScotchPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, HopScotchPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, HopScotchPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, HopScotchPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, HopScotchPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, UnorderedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, UnorderedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, UnorderedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, UnorderedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, UnorderedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, DensePayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, DensePayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, DensePayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, DensePayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadLookup, DensePayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+
+BENCHMARK_TEMPLATE(BM_PayloadErase, InlinedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, InlinedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, InlinedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, InlinedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, InlinedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, HopScotchPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, HopScotchPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, HopScotchPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, HopScotchPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, HopScotchPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, UnorderedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, UnorderedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, UnorderedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, UnorderedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, UnorderedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, DensePayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, DensePayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, DensePayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, DensePayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadErase, DensePayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+
+BENCHMARK_TEMPLATE(BM_PayloadIterate, InlinedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, InlinedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, InlinedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, InlinedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, InlinedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, HopScotchPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, HopScotchPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, HopScotchPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, HopScotchPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, HopScotchPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, UnorderedPayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, UnorderedPayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, UnorderedPayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, UnorderedPayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, UnorderedPayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, DensePayloadMap<8>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, DensePayloadMap<32>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, DensePayloadMap<64>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, DensePayloadMap<128>)
+    ->Apply(PayloadTestArgs);
+BENCHMARK_TEMPLATE(BM_PayloadIterate, DensePayloadMap<256>)
+    ->Apply(PayloadTestArgs);
+
+BENCHMARK_TEMPLATE(BM_Iterate, HopScotchBenchmarkMap<int>)
+    ->Apply(IterateTestArgs);
+BENCHMARK_TEMPLATE(BM_Iterate, HopScotchBitmapBenchmarkMap<int>)
+    ->Apply(IterateTestArgs);
+BENCHMARK_TEMPLATE(BM_Iterate, InlinedBenchmarkMap<int>)
+    ->Apply(IterateTestArgs);
+BENCHMARK_TEMPLATE(BM_Iterate, InlinedBitmapBenchmarkMap<int>)
+    ->Apply(IterateTestArgs);
+BENCHMARK_TEMPLATE(BM_Iterate, UnorderedBenchmarkMap<int>)
+    ->Apply(IterateTestArgs);
+BENCHMARK_TEMPLATE(BM_Iterate, DenseBenchmarkMap<int>)->Apply(IterateTestArgs);
+
+void BM_SharedLookup_HopScotchMap_Int(benchmark::State& state) {
+  DoSharedLookupTest<HopScotchHashMap<int, SharedCounter, 0>>(state, false);
+}
+BENCHMARK(BM_SharedLookup_HopScotchMap_Int)->Apply(SharedLookupTestArgs);
+
+void BM_SharedLookup_InlinedMap_Int(benchmark::State& state) {
+  DoSharedLookupTest<InlinedHashMap<int, SharedCounter, 0, MapOptions<int>>>(
+      state, false);
+}
+BENCHMARK(BM_SharedLookup_InlinedMap_Int)->Apply(SharedLookupTestArgs);
+
+void BM_SharedLookupWithWriter_HopScotchMap_Int(benchmark::State& state) {
+  DoSharedLookupTest<HopScotchHashMap<int, SharedCounter, 0>>(state, true);
+}
+BENCHMARK(BM_SharedLookupWithWriter_HopScotchMap_Int)
+    ->Apply(SharedLookupTestArgs);
+
+void BM_SharedLookupWithWriter_InlinedMap_Int(benchmark::State& state) {
+  DoSharedLookupTest<InlinedHashMap<int, SharedCounter, 0, MapOptions<int>>>(
+      state, true);
+}
+BENCHMARK(BM_SharedLookupWithWriter_InlinedMap_Int)
+    ->Apply(SharedLookupTestArgs);
+
+BENCHMARK_TEMPLATE(BM_InsertLatency, HopScotchBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_InsertLatency, InlinedBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_InsertLatency, UnorderedBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_InsertLatency, DenseBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+
+BENCHMARK_TEMPLATE(BM_ChurnLatency, HopScotchBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_ChurnLatency, InlinedBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_ChurnLatency, UnorderedBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_ChurnLatency, DenseBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+
+BENCHMARK_TEMPLATE(BM_LookupLatency, HopScotchBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_LookupLatency, InlinedBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_LookupLatency, UnorderedBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+BENCHMARK_TEMPLATE(BM_LookupLatency, DenseBenchmarkMap<int>)
+    ->Apply(LatencyTestArgs);
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   bool run_benchmark = false;
@@ -502,6 +3290,10 @@ int main(int argc, char** argv) {
       //ProfilerStart(cpu_profile);
       //atexit(ProfilerStop);
     }
+    if (strcmp(argv[i], "--perf_counters") == 0) {
+      enable_perf_counters = true;
+      run_benchmark = true;
+    }
     if (strncmp(argv[i], "--benchmark", 11) == 0) {
       run_benchmark = true;
     }